@@ -14,10 +14,13 @@
 #include <Library/UefiLib.h>
 #include <Library/PrintLib.h>
 #include <Library/BaseMemoryLib.h>
+#include <Library/BaseLib.h>
 #include <Protocol/LoadedImage.h>
 #include <Protocol/UnicodeCollation.h>
 #include <Library/UefiDevicePathLib/UefiDevicePathLib.h>
 
+#include "Kldr.h"
+
 void EFIAPI boot_lin64(UINT64, UINT64);
 void EFIAPI _sgdt(UINT64);
 void EFIAPI _lgdt(UINT64);
@@ -30,6 +33,9 @@ UINT64 EFIAPI chg_csds(UINT64 cs, UINT64 ds);
 
 #define E820_MAX_ENTRIES_ZEROPAGE 128
 
+#define XLF_KERNEL_64                  0x01
+#define XLF_CAN_BE_LOADED_ABOVE_4G     0x02
+
 typedef struct {
    UINT16   limit;
    UINT64   addr;
@@ -176,7 +182,7 @@ typedef struct {
 
    UINT8       _rsvd7[2];
 
-   UINT8       sentinel;            // 0xff
+   UINT8       sentinel;            // must be 0
 
    UINT8       _rsvd8[1];
 
@@ -190,8 +196,144 @@ typedef struct {
    UINT8       _rsvd11[816];
 } boot_params;
 
+typedef struct {
+   UINT64   next;
+   UINT32   type;
+   UINT32   len;
+} setup_data;
+
 #pragma pack(pop)
 
+#define PHASE_PLAN      0
+#define PHASE_KERNEL    1
+#define PHASE_CMDLINE   2
+#define PHASE_INITRD    3
+#define PHASE_CRASH     4
+#define PHASE_DESC      5
+#define PHASE_GRAPHICS  6
+#define PHASE_MEMMAP    7
+#define PHASE_TOTAL     8
+#define PHASE_COUNT     9
+
+#define LOG_DEFAULT_LEVEL  LOG_ERR
+#define LOG_RING_SIZE      (64 * 1024)
+#define LOG_LINE_SIZE      256
+#define LOG_FILE           L"kldr.log"
+
+// Descriptors the memory map may gain between the plan and the read of it,
+// each allocation splits a free range in up to three.
+//
+#define MEMMAP_SLACK       32
+
+// setup_data type of the log passed to the kernel.
+// The kernel ignores unknown types, but reserves them and shows them
+// in /sys/kernel/boot_params/setup_data.
+//
+#define SETUP_KLDR_LOG     0x4b4c4f47  // "KLOG"
+
+// setup_data types of the preloaded kdump kernel and initrd,
+// the payload is the file as it is on the disk.
+//
+#define SETUP_KLDR_CRASH_KERNEL  0x4b43524b  // "KCRK"
+#define SETUP_KLDR_CRASH_INITRD  0x4b435249  // "KCRI"
+
+#define CRASH_SIZE_DEFAULT 256   // MB, crashkernel= reserved by linux
+
+// BootOrder is rewritten at most once per this interval (seconds)
+// unless "reorder" is given, 0 means only on request.
+//
+#ifndef KLDR_REORDER_INTERVAL
+#define KLDR_REORDER_INTERVAL    (24 * 60 * 60)
+#endif
+
+#define KLDR_PATH_MAX   256
+#define KLDR_ID_MAX     32
+#define KLDR_DESC_MAX   64
+#define KLDR_ENTRIES    L"entries.txt"
+#define KLDR_MENU_MAX   9     // entries chosen by a digit
+
+#define BENCH_DEFAULT   10
+#define BENCH_MAX       1000
+#define BENCH_ALLOCS    3     // pool calls, pages calls, page KiB
+
+typedef struct {
+   boot_params*   params;
+
+   GDTR     gdtr;
+   UINT64   tmp_cs;
+   UINT64   tmp_ds;
+
+   UINT32   disp_mode;
+
+   UINTN    Key;
+} boot_state;
+
+typedef struct {
+   UINTN    pool;
+   UINTN    pool_free;
+   UINTN    pages;
+   UINTN    pages_free;
+   UINT64   page_bytes;
+} alloc_stat;
+
+typedef struct {
+   CHAR8*   buf;
+   UINTN    head;
+   UINTN    len;
+   UINTN    level;
+} log_ring;
+
+typedef struct {
+   UINTN    written;
+   UINTN    avoided;
+   UINTN    failed;
+} nv_stat;
+
+// Where the kernel, initrd and kernel parameter are read from.
+// "N:path" reads from the ext4 partition N of the same disk,
+// anything else from the filesystem Kldr.efi is on.
+//
+typedef struct {
+   CHAR16   kernel[KLDR_PATH_MAX];
+   CHAR16   initrd[KLDR_PATH_MAX];
+   CHAR16   cmdline[KLDR_PATH_MAX];
+
+   // kdump kernel and initrd, not loaded when crash_kernel is empty
+   //
+   CHAR16   crash_kernel[KLDR_PATH_MAX];
+   CHAR16   crash_initrd[KLDR_PATH_MAX];
+   UINT64   crash_size;
+} boot_entry;
+
+// A line of entries.txt.
+//
+typedef struct {
+   CHAR16      id[KLDR_ID_MAX];
+   CHAR16      desc[KLDR_DESC_MAX];
+   boot_entry  files;
+} kldr_entry;
+
+typedef struct {
+   boot_entry  entry;
+   CHAR16      entry_id[KLDR_ID_MAX];
+
+   UINTN    boot;
+   UINTN    install;
+   UINTN    chg_order;
+   UINTN    reorder;
+   UINT64   reorder_interval;
+   UINTN    bench;
+   UINTN    cache;
+   UINTN    timeout;
+} kldr_param;
+
+static alloc_stat alloc_count;
+static log_ring   kmsg = { 0, 0, 0, LOG_DEFAULT_LEVEL };
+static nv_stat    nv_count;
+static UINT64     memmap_bytes;
+
+static EFI_GUID   kldr_var_guid = KLDR_VARIABLE_GUID;
+
 #define AddressRangeMemory             1
 #define AddressRangeReserved           2
 #define AddressRangeACPI               3
@@ -235,13 +377,22 @@ VOID cnv_efi_to_acpi(e820_entry* acpi, const EFI_MEMORY_DESCRIPTOR* efi)
    acpi->type = type_efi_to_acpi(efi->Type);
 }
 
+#ifndef KLDR_BOOT_ONLY
 CHAR16 getchar(VOID)
 {
    EFI_INPUT_KEY key;
 
    EFI_STATUS  Status;
 
+   // halt until a key arrives instead of spinning on ReadKeyStroke
+   //
    do {
+      UINTN index;
+
+      Status = gBS->WaitForEvent(1, &gST->ConIn->WaitForKey, &index);
+      if (EFI_ERROR(Status)) {
+         return 0;
+      }
       Status = gST->ConIn->ReadKeyStroke(gST->ConIn, &key);
    } while (Status == EFI_NOT_READY);
    if (EFI_ERROR(Status)) {
@@ -250,6 +401,7 @@ CHAR16 getchar(VOID)
 
    return key.UnicodeChar;
 }
+#endif
 
 VOID* malloc_pool(UINTN size)
 {
@@ -261,6 +413,7 @@ VOID* malloc_pool(UINTN size)
    if (EFI_ERROR(Status)) {
       return 0; // EFI_OUT_OF_RESOURCES;
    }
+   ++alloc_count.pool;
 
    return ptr;
 }
@@ -268,6 +421,7 @@ VOID* malloc_pool(UINTN size)
 VOID free_pool(VOID* ptr)
 {
    gBS->FreePool(ptr);
+   ++alloc_count.pool_free;
 }
 
 VOID* malloc_pages(UINT64 size)
@@ -280,6 +434,8 @@ VOID* malloc_pages(UINT64 size)
    if (EFI_ERROR(Status)) {
       return 0;
    }
+   ++alloc_count.pages;
+   alloc_count.page_bytes += (size + 4095) & ~4095ULL;
 
    return (VOID*)addr;
 }
@@ -287,6 +443,7 @@ VOID* malloc_pages(UINT64 size)
 VOID free_pages(VOID* ptr, UINT64 size)
 {
    gBS->FreePages((EFI_PHYSICAL_ADDRESS)ptr, (size + 4095) / 4096);
+   ++alloc_count.pages_free;
 }
 
 VOID* malloc_pages_at(UINT64 size, EFI_PHYSICAL_ADDRESS addr)
@@ -297,10 +454,218 @@ VOID* malloc_pages_at(UINT64 size, EFI_PHYSICAL_ADDRESS addr)
    if (EFI_ERROR(Status)) {
       return 0;
    }
+   ++alloc_count.pages;
+   alloc_count.page_bytes += (size + 4095) & ~4095ULL;
 
    return (VOID*)addr;
 }
 
+// Allocate pages at the alignment, ending at or below limit.
+// Boot services have no alignment, so align more is taken and
+// the head and the tail are given back.
+//
+VOID* malloc_aligned_pages(UINT64 size, UINT64 align, UINT64 limit)
+{
+   EFI_PHYSICAL_ADDRESS addr;
+   EFI_PHYSICAL_ADDRESS at;
+   UINT64   total;
+
+   EFI_STATUS  Status;
+
+   if (align < 4096) {
+      align = 4096;
+   }
+   size = (size + 4095) & ~4095ULL;
+   total = (align > 4096) ? size + align : size;
+
+   addr = limit;
+   Status = gBS->AllocatePages(AllocateMaxAddress, EfiLoaderData, total / 4096, &addr);
+   if (EFI_ERROR(Status)) {
+      return 0;
+   }
+
+   at = (addr + align - 1) & ~(align - 1);
+   if (at > addr) {
+      gBS->FreePages(addr, (at - addr) / 4096);
+   }
+   if (at + size < addr + total) {
+      gBS->FreePages(at + size, (addr + total - at - size) / 4096);
+   }
+   ++alloc_count.pages;
+   alloc_count.page_bytes += size;
+
+   return (VOID*)at;
+}
+
+// Take the pages planned for what, or allocate them on the node of
+// the BSP, falling back to any node when the machine is not NUMA or
+// the node has no room. The alignment and the limit hold in every case.
+//
+VOID* malloc_local_pages(UINT64 size, UINT64 align, UINT64 limit, CONST CHAR16* what)
+{
+   EFI_PHYSICAL_ADDRESS addr;
+   VOID*    ptr;
+   UINT32   node;
+
+   ptr = plan_take(what, size);
+   if (!ptr && !EFI_ERROR(numa_find(size, align, limit, &addr))) {
+      ptr = malloc_pages_at(size, addr);
+   }
+
+   if (!ptr) {
+      ptr = malloc_aligned_pages(size, align, limit);
+      if (!ptr) {
+         return 0;
+      }
+   }
+
+   node = numa_node((UINT64)ptr);
+   if (node != NUMA_NO_NODE) {
+      klog(LOG_INFO, L"%s at %lx on node %d\r\n", what, (UINT64)ptr, node);
+   }
+
+   return ptr;
+}
+
+
+
+EFI_STATUS log_init(VOID)
+{
+   kmsg.buf = malloc_pool(LOG_RING_SIZE);
+   if (!kmsg.buf) {
+      return EFI_OUT_OF_RESOURCES;
+   }
+   kmsg.head = 0;
+   kmsg.len = 0;
+
+   return EFI_SUCCESS;
+}
+
+VOID log_put(CHAR8 c)
+{
+   kmsg.buf[(kmsg.head + kmsg.len) % LOG_RING_SIZE] = c;
+
+   if (kmsg.len < LOG_RING_SIZE) {
+      ++kmsg.len;
+   } else {
+      kmsg.head = (kmsg.head + 1) % LOG_RING_SIZE;
+   }
+}
+
+// Every message is kept in the ring buffer,
+// only messages up to the configured level are sent to ConOut.
+//
+VOID EFIAPI klog(UINTN level, CONST CHAR16* fmt, ...)
+{
+   CHAR16   line[LOG_LINE_SIZE];
+   UINTN    len;
+   VA_LIST  args;
+
+   VA_START(args, fmt);
+   len = UnicodeVSPrint(line, sizeof(line), fmt, args);
+   VA_END(args);
+
+   if (kmsg.buf) {
+      log_put('<');
+      log_put((CHAR8)('0' + level));
+      log_put('>');
+
+      for (UINTN i = 0; i < len; ++i) {
+         if (line[i] == L'\r') {
+            continue;
+         }
+         log_put(line[i] < 0x80 ? (CHAR8)line[i] : '?');
+      }
+   }
+
+   if (level <= kmsg.level) {
+      gST->ConOut->OutputString(gST->ConOut, line);
+   }
+}
+
+// Copy the ring buffer to buf in order, return the number of bytes.
+//
+UINTN log_copy(CHAR8* buf)
+{
+   UINTN first;
+
+   first = LOG_RING_SIZE - kmsg.head;
+   if (first > kmsg.len) {
+      first = kmsg.len;
+   }
+
+   CopyMem(buf, kmsg.buf + kmsg.head, first);
+   CopyMem(buf + first, kmsg.buf, kmsg.len - first);
+
+   return kmsg.len;
+}
+
+// Pass the log to the kernel as setup_data.
+//
+EFI_STATUS attach_log(boot_params* params)
+{
+   setup_data* data;
+
+   if (!kmsg.buf || !kmsg.len) {
+      return EFI_NOT_FOUND;
+   }
+
+   data = malloc_local_pages(sizeof(setup_data) + kmsg.len, EFI_PAGE_SIZE, MAX_UINT64, L"log");
+   if (!data) {
+      return EFI_OUT_OF_RESOURCES;
+   }
+
+   data->type = SETUP_KLDR_LOG;
+   data->len = (UINT32)log_copy((CHAR8*)(data + 1));
+
+   data->next = params->hdr.setup_data;
+   params->hdr.setup_data = (UINT64)data;
+
+   return EFI_SUCCESS;
+}
+
+// Write the log to the file on the ESP.
+//
+EFI_STATUS save_log(EFI_FILE_PROTOCOL* root)
+{
+   EFI_FILE_PROTOCOL*   file;
+   CHAR8*   buf;
+   UINTN    size;
+
+   EFI_STATUS  Status;
+
+   if (!kmsg.buf) {
+      return EFI_NOT_FOUND;
+   }
+
+   // truncate the old log
+   //
+   Status = root->Open(root, &file, LOG_FILE, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
+   if (!EFI_ERROR(Status)) {
+      file->Delete(file);
+   }
+
+   Status = root->Open(root, &file, LOG_FILE,
+         EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE, 0);
+   if (EFI_ERROR(Status)) {
+      return Status;
+   }
+
+   buf = malloc_pool(LOG_RING_SIZE);
+   if (!buf) {
+      file->Close(file);
+      return EFI_OUT_OF_RESOURCES;
+   }
+
+   size = log_copy(buf);
+   Status = file->Write(file, &size, buf);
+
+   free_pool(buf);
+   file->Close(file);
+
+   return Status;
+}
+
 
 EFI_STATUS get_file_size(EFI_FILE_PROTOCOL* file, UINT64* size)
 {
@@ -359,7 +724,7 @@ EFI_STATUS chk_linux(setup_header* header)
       return EFI_UNSUPPORTED;
    }
 
-   if (!(header->xloadflags & 0x01)) { // not XFL_KERNEL_64
+   if (!(header->xloadflags & XLF_KERNEL_64)) {
       return EFI_UNSUPPORTED;
    }
 
@@ -456,6 +821,7 @@ UINT8 start_bit(UINT32 c)
    return n;
 }
 
+#ifndef KLDR_BOOT_ONLY
 VOID dump_gdt(GDTR* gdtr)
 {
    DESC* desc = (DESC*)gdtr->addr;
@@ -475,6 +841,7 @@ VOID dump_gdt(GDTR* gdtr)
          );
    }
 }
+#endif
 
 VOID modify_gdt(GDTR* gdtr, UINTN new_cs, UINTN new_ds)
 {
@@ -536,11 +903,31 @@ VOID release_desc(GDTR* gdtr)
    free_pool((VOID*)gdtr->addr);
 }
 
+// Highest address the kernel, cmdline and initrd can be loaded at.
+//
+UINT64 load_limit(setup_header* header)
+{
+   if (header->xloadflags & XLF_CAN_BE_LOADED_ABOVE_4G) {
+      return MAX_UINT64;
+   }
+
+   return 0xffffffff;
+}
+
+UINT64 initrd_limit(setup_header* header)
+{
+   if (header->xloadflags & XLF_CAN_BE_LOADED_ABOVE_4G) {
+      return MAX_UINT64;
+   }
+
+   return header->initrd_addr_max;
+}
+
 boot_params* init_zeropage(VOID)
 {
    boot_params*   params;
 
-   params = malloc_pool(sizeof(boot_params));
+   params = malloc_local_pages(sizeof(boot_params), EFI_PAGE_SIZE, 0xffffffff, L"zeropage");
    if (!params) {
       return 0;
    }
@@ -553,18 +940,22 @@ VOID release_zeropage(boot_params* params)
 {
    UINT64 ptr;
 
+   // free what the plan reserved and no load took
+   //
+   plan_release();
+
    // free kernel pages
    //
    if (params->hdr.pref_address) {
       free_pages((VOID*)params->hdr.pref_address, params->hdr.init_size);
    }
 
-   // free command line pool
+   // free command line pages
    //
    ptr = (UINT64)params->ext_cmd_line_ptr << 32;
    ptr += params->hdr.cmd_line_ptr;
    if (ptr) {
-      free_pool((VOID*)ptr);
+      free_pages((VOID*)ptr, params->hdr.cmdline_size + 1);
    }
 
    // free initrd pages
@@ -580,17 +971,54 @@ VOID release_zeropage(boot_params* params)
       free_pages((VOID*)ptr, size);
    }
 
-   // free efi memory map pool
+   // free setup_data pages
+   //
+   ptr = params->hdr.setup_data;
+   while (ptr) {
+      setup_data* data = (setup_data*)ptr;
+
+      ptr = data->next;
+      free_pages(data, sizeof(setup_data) + data->len);
+   }
+
+   // free efi memory map pages
    //
    ptr = (UINT64)params->efi_info.efi_memmap_hi << 32;
    ptr += params->efi_info.efi_memmap;
    if (ptr) {
-      free_pool((VOID*)ptr);
+      free_pages((VOID*)ptr, memmap_bytes);
+   }
+
+   // free params pages
+   //
+   free_pages(params, sizeof(boot_params));
+}
+
+// Open the file without the cache, which would read all of it.
+//
+EFI_STATUS open_raw(EFI_FILE_PROTOCOL* root, CHAR16* name, EFI_FILE_PROTOCOL** file)
+{
+   if (ext4_source(name)) {
+      return ext4_open(name, file);
+   }
+
+   return root->Open(root, file, name, EFI_FILE_MODE_READ, 0);
+}
+
+EFI_STATUS open_file(EFI_FILE_PROTOCOL* root, CHAR16* name, EFI_FILE_PROTOCOL** file)
+{
+   EFI_STATUS  Status;
+
+   Status = open_raw(root, name, file);
+   if (EFI_ERROR(Status)) {
+      return Status;
    }
 
-   // free params pool
+   // served from the warm reset cache when it is enabled
    //
-   free_pool(params);
+   cache_open(name, file);
+
+   return EFI_SUCCESS;
 }
 
 EFI_STATUS load_kernel_header(boot_params* params, EFI_FILE_PROTOCOL* file)
@@ -651,17 +1079,14 @@ EFI_STATUS load_kernel_header(boot_params* params, EFI_FILE_PROTOCOL* file)
          if (!EFI_ERROR(Status)) {
             kver[511] = 0;
 
-            Print(L"linux %a\r\n", kver);
+            klog(LOG_INFO, L"linux %a\r\n", kver);
          }
       }
    }
 
-   params->sentinel = 0xff;
-
    return EFI_SUCCESS;
 }
 
-
 EFI_STATUS load_linux32(EFI_FILE_PROTOCOL* file, setup_header* header)
 {
    UINTN size;
@@ -673,7 +1098,7 @@ EFI_STATUS load_linux32(EFI_FILE_PROTOCOL* file, setup_header* header)
    //Print(L"protected code size = %d\r\n", size);
 
    if (header->relocatable_kernel) {
-      prot = malloc_pages(header->init_size);
+      prot = malloc_local_pages(header->init_size, header->kernel_alignment, load_limit(header), L"kernel");
       if (!prot) {
          header->pref_address = 0;
          return EFI_OUT_OF_RESOURCES;
@@ -681,10 +1106,13 @@ EFI_STATUS load_linux32(EFI_FILE_PROTOCOL* file, setup_header* header)
       header->pref_address = (UINT64)prot;
 
    } else {
-      prot = malloc_pages_at(header->init_size, header->pref_address);
+      prot = plan_take(L"kernel", header->init_size);
+      if (!prot) {
+         prot = malloc_pages_at(header->init_size, header->pref_address);
+      }
 
       if (!prot) {
-         Print(L"cannot allocate kernel memory at %X\r\n", header->pref_address);
+         klog(LOG_ERR, L"cannot allocate kernel memory at %lX\r\n", header->pref_address);
          header->pref_address = 0;
          return EFI_OUT_OF_RESOURCES;
       }
@@ -694,7 +1122,6 @@ EFI_STATUS load_linux32(EFI_FILE_PROTOCOL* file, setup_header* header)
 
    Status = file->SetPosition(file, (1 + header->setup_sects) * 512);
    if (EFI_ERROR(Status)) {
-      header->pref_address = 0;
       return Status;
    }
 
@@ -714,18 +1141,20 @@ EFI_STATUS load_kernel(EFI_FILE_PROTOCOL* root, CHAR16* bzImage, boot_params* pa
 
    EFI_STATUS  Status;
 
-   Status = root->Open(root, &file, bzImage, EFI_FILE_MODE_READ, 0);
+   Status = open_file(root, bzImage, &file);
    if (EFI_ERROR(Status)) {
       return Status;
    }
 
    Status = load_kernel_header(params, file);
    if (EFI_ERROR(Status)) {
+      file->Close(file);
       return Status;
    }
 
    Status = load_linux32(file, &params->hdr);
    if (EFI_ERROR(Status)) {
+      file->Close(file);
       return Status;
    }
 
@@ -747,18 +1176,27 @@ EFI_STATUS init_cmdline(EFI_FILE_PROTOCOL* root, CHAR16* config, boot_params* pa
 
    EFI_STATUS  Status;
 
-   Status = root->Open(root, &file, config, EFI_FILE_MODE_READ, 0);
+   Status = open_file(root, config, &file);
    if (EFI_ERROR(Status)) {
       return Status;
    }
 
    Status = get_file_size(file, &size);
    if (EFI_ERROR(Status)) {
+      file->Close(file);
       return Status;
    }
 
-   cmdline = malloc_pool(size + 1);
-   if (EFI_ERROR(Status)) {
+   // the kernel reads no more than cmdline_size bytes
+   //
+   if (size > params->hdr.cmdline_size) {
+      klog(LOG_WARN, L"%s is truncated to %d bytes\r\n", config, params->hdr.cmdline_size);
+      size = params->hdr.cmdline_size;
+   }
+
+   cmdline = malloc_local_pages(params->hdr.cmdline_size + 1, EFI_PAGE_SIZE, load_limit(&params->hdr), L"cmdline");
+   if (!cmdline) {
+      file->Close(file);
       return EFI_OUT_OF_RESOURCES;
    }
 
@@ -768,6 +1206,7 @@ EFI_STATUS init_cmdline(EFI_FILE_PROTOCOL* root, CHAR16* config, boot_params* pa
    read = size;
    Status = file->Read(file, &read, cmdline);
    if (EFI_ERROR(Status)) {
+      file->Close(file);
       return Status;
    }
    cmdline[read] = 0;
@@ -791,7 +1230,7 @@ EFI_STATUS load_initrd(EFI_FILE_PROTOCOL* root, CHAR16* initrd, boot_params* par
 
    EFI_STATUS  Status;
 
-   Status = root->Open(root, &file, initrd, EFI_FILE_MODE_READ, 0);
+   Status = open_file(root, initrd, &file);
    if (EFI_ERROR(Status)) {
       return Status;
    }
@@ -800,16 +1239,25 @@ EFI_STATUS load_initrd(EFI_FILE_PROTOCOL* root, CHAR16* initrd, boot_params* par
 
    Status = get_file_size(file, &size);
    if (EFI_ERROR(Status)) {
+      file->Close(file);
       return Status;
    }
 
-   load_addr = malloc_pages(size);
+   // an empty initrd is booted as no initrd
+   //
+   if (!size) {
+      klog(LOG_WARN, L"%s is empty\r\n", initrd);
+      return file->Close(file);
+   }
+
+   load_addr = malloc_local_pages(size, EFI_PAGE_SIZE, initrd_limit(&params->hdr), L"initrd");
    if (!load_addr) {
+      file->Close(file);
       return EFI_OUT_OF_RESOURCES;
    }
 
-   Print(L"initrd load address = %lx\r\n", (UINT64)load_addr);
-   Print(L"initrd size = %ld\r\n", size);
+   klog(LOG_INFO, L"initrd load address = %lx\r\n", (UINT64)load_addr);
+   klog(LOG_INFO, L"initrd size = %ld\r\n", size);
 
    params->hdr.ramdisk_image = (UINT64)load_addr & 0xffffffff;
    params->ext_ramdisk_image = (UINT64)load_addr >> 32;
@@ -819,6 +1267,7 @@ EFI_STATUS load_initrd(EFI_FILE_PROTOCOL* root, CHAR16* initrd, boot_params* par
 
    Status = file->Read(file, &size, load_addr);
    if (EFI_ERROR(Status)) {
+      file->Close(file);
       return Status;
    }
 
@@ -830,6 +1279,120 @@ EFI_STATUS load_initrd(EFI_FILE_PROTOCOL* root, CHAR16* initrd, boot_params* par
    return EFI_SUCCESS;
 }
 
+// Read the whole file into a setup_data node of the type.
+// Linux reserves every setup_data node before its first allocation and
+// KASLR does not decompress over one, so the file stays intact and can be
+// read back from /sys/kernel/boot_params/setup_data/N/data.
+//
+EFI_STATUS attach_file(EFI_FILE_PROTOCOL* root, CHAR16* name, UINT32 type, CONST CHAR16* what, boot_params* params)
+{
+   EFI_FILE_PROTOCOL*   file;
+   setup_data*    data;
+   UINT64   size;
+   UINTN    read;
+
+   EFI_STATUS  Status;
+
+   Status = open_file(root, name, &file);
+   if (EFI_ERROR(Status)) {
+      return Status;
+   }
+
+   Status = get_file_size(file, &size);
+   if (EFI_ERROR(Status)) {
+      file->Close(file);
+      return Status;
+   }
+
+   if (size > MAX_UINT32) {
+      file->Close(file);
+      return EFI_BAD_BUFFER_SIZE;
+   }
+
+   data = malloc_local_pages(sizeof(setup_data) + size, EFI_PAGE_SIZE, MAX_UINT64, what);
+   if (!data) {
+      file->Close(file);
+      return EFI_OUT_OF_RESOURCES;
+   }
+
+   read = size;
+   Status = file->Read(file, &read, data + 1);
+   file->Close(file);
+   if (!EFI_ERROR(Status) && read != size) {
+      Status = EFI_END_OF_FILE;
+   }
+   if (EFI_ERROR(Status)) {
+      free_pages(data, sizeof(setup_data) + size);
+      return Status;
+   }
+
+   data->type = type;
+   data->len = (UINT32)size;
+   data->next = params->hdr.setup_data;
+   params->hdr.setup_data = (UINT64)data;
+
+   return EFI_SUCCESS;
+}
+
+// Keep the kdump kernel and its initrd in setup_data and add
+// crashkernel= to the command line, so that arming kdump is a
+// "kexec -p" of the two files in /sys, without reading the disk.
+// Linux chooses the crashkernel= range itself.
+//
+EFI_STATUS load_crash(EFI_FILE_PROTOCOL* root, boot_entry* entry, boot_params* params)
+{
+   setup_header   hdr;
+   setup_data*    data;
+   CHAR8*   cmdline;
+   CHAR8    arg[64];
+
+   EFI_STATUS  Status;
+
+   if (!entry->crash_kernel[0]) {
+      return EFI_SUCCESS;
+   }
+
+   Status = attach_file(root, entry->crash_kernel, SETUP_KLDR_CRASH_KERNEL, L"crash_kernel", params);
+   if (EFI_ERROR(Status)) {
+      return Status;
+   }
+
+   // the header goes through the same checks as the kernel, on a copy,
+   // the file must stay as it is
+   //
+   data = (setup_data*)params->hdr.setup_data;
+   SetMem(&hdr, sizeof(hdr), 0);
+   if (data->len >= 0x1f1 + sizeof(hdr)) {
+      CopyMem(&hdr, (UINT8*)(data + 1) + 0x1f1, sizeof(hdr));
+   }
+   if (EFI_ERROR(chk_linux(&hdr)) || !hdr.relocatable_kernel) {
+      klog(LOG_ERR, L"%s is not a relocatable 64-bit kernel\r\n", entry->crash_kernel);
+      return EFI_UNSUPPORTED;
+   }
+
+   if (entry->crash_initrd[0]) {
+      Status = attach_file(root, entry->crash_initrd, SETUP_KLDR_CRASH_INITRD, L"crash_initrd", params);
+      if (EFI_ERROR(Status)) {
+         klog(LOG_ERR, L"%s load failed:%r\r\n", entry->crash_initrd, Status);
+         return Status;
+      }
+   }
+
+   // the last crashkernel= wins, one in the kernel parameter file is overridden
+   //
+   cmdline = (CHAR8*)((((UINT64)params->ext_cmd_line_ptr) << 32) + params->hdr.cmd_line_ptr);
+   AsciiSPrint(arg, sizeof(arg), " crashkernel=%ldM", entry->crash_size);
+   if (AsciiStrLen(cmdline) + AsciiStrLen(arg) > params->hdr.cmdline_size) {
+      klog(LOG_ERR, L"no room for crashkernel= in the kernel parameter\r\n");
+      return EFI_BUFFER_TOO_SMALL;
+   }
+   AsciiStrCatS(cmdline, params->hdr.cmdline_size + 1, arg);
+
+   klog(LOG_INFO, L"crash kernel kept in setup_data%a\r\n", arg);
+
+   return EFI_SUCCESS;
+}
+
 EFI_STATUS setup_graphics(boot_params* params, UINT32* orig)
 {
    EFI_GRAPHICS_OUTPUT_PROTOCOL* gout;
@@ -845,15 +1408,10 @@ EFI_STATUS setup_graphics(boot_params* params, UINT32* orig)
    }
    *orig = gout->Mode->Mode;
 
-   ginfo_size = sizeof(EFI_GRAPHICS_OUTPUT_MODE_INFORMATION);
-   ginfo = malloc_pool(ginfo_size);
-   if (!ginfo) {
-      return EFI_OUT_OF_RESOURCES;
-   }
-
+   // QueryMode allocates the information buffer by itself
+   //
    Status = gout->QueryMode(gout, gout->Mode->MaxMode - 1, &ginfo_size, &ginfo);
    if (EFI_ERROR(Status)) {
-      free_pool(ginfo);
       return Status;
    }
 
@@ -862,7 +1420,7 @@ EFI_STATUS setup_graphics(boot_params* params, UINT32* orig)
 
    switch (ginfo->PixelFormat) {
       case PixelRedGreenBlueReserved8BitPerColor:
-         Print(L"PixelRedGreenBlueReserved8BitPerColor\r\n");
+         klog(LOG_DEBUG, L"PixelRedGreenBlueReserved8BitPerColor\r\n");
 
          params->screen_info.lfb_depth  = 32;
 
@@ -878,7 +1436,7 @@ EFI_STATUS setup_graphics(boot_params* params, UINT32* orig)
          break;
 
       case PixelBlueGreenRedReserved8BitPerColor:
-         Print(L"PixelBlueGreenRedReserved8BitPerColor\r\n");
+         klog(LOG_DEBUG, L"PixelBlueGreenRedReserved8BitPerColor\r\n");
 
          params->screen_info.lfb_depth  = 32;
 
@@ -894,7 +1452,7 @@ EFI_STATUS setup_graphics(boot_params* params, UINT32* orig)
          break;
 
       case PixelBitMask:
-         Print(L"PixelBitMask\r\n");
+         klog(LOG_DEBUG, L"PixelBitMask\r\n");
 
          params->screen_info.red_size   = count_bits(ginfo->PixelInformation.RedMask);
          params->screen_info.green_size = count_bits(ginfo->PixelInformation.GreenMask);
@@ -928,7 +1486,7 @@ EFI_STATUS setup_graphics(boot_params* params, UINT32* orig)
 
    params->screen_info.capabilities = 0x02; // VIDEO_CAPABILITY_64BIT_BASE
 
-   free_pool(ginfo);
+   gBS->FreePool(ginfo);
 
    Status = gout->SetMode(gout, gout->Mode->MaxMode - 1);
    if (EFI_ERROR(Status)) {
@@ -972,13 +1530,26 @@ EFI_STATUS init_memory_map(UINTN* Key, boot_params* params)
       return EFI_NOT_FOUND;
    }
 
-   MapSize = 4096;
+   MapSize = 0;
+   Status = gBS->GetMemoryMap(&MapSize, NULL, Key, &DescSize, &DescVer);
+   if (Status != EFI_BUFFER_TOO_SMALL) {
+      return Status;
+   }
+
    while (1) {
-      UINTN sz = MapSize;
-      MemoryMap = malloc_pool(MapSize);
+      UINTN sz = MapSize + 4 * DescSize;
+
+      MemoryMap = malloc_local_pages(sz, EFI_PAGE_SIZE, MAX_UINT64, L"memmap");
       if (!MemoryMap) {
          return EFI_OUT_OF_RESOURCES;
       }
+      memmap_bytes = sz;
+
+      // the last change of the map before it is read
+      //
+      plan_release();
+
+      MapSize = sz;
       Status = gBS->GetMemoryMap(
             &MapSize,
             (EFI_MEMORY_DESCRIPTOR*)MemoryMap,
@@ -990,13 +1561,11 @@ EFI_STATUS init_memory_map(UINTN* Key, boot_params* params)
          break;
       }
 
-      free_pool(MemoryMap);
+      free_pages(MemoryMap, sz);
 
       if (Status != EFI_BUFFER_TOO_SMALL) {
          return Status;
       }
-
-      MapSize = sz + 4096;
    }
 
    params->efi_info.efi_memmap = (UINT64)MemoryMap & 0xffffffff;
@@ -1016,122 +1585,568 @@ EFI_STATUS init_memory_map(UINTN* Key, boot_params* params)
    return EFI_SUCCESS;
 }
 
-EFI_STATUS boot_linux(VOID)
+EFI_STATUS open_root(EFI_FILE_PROTOCOL** root)
 {
    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* fs;
-   EFI_FILE_PROTOCOL*               root;
    EFI_DEVICE_PATH_PROTOCOL*        root_devpath;
 
    EFI_GUID       loaded_dp_guid = EFI_LOADED_IMAGE_DEVICE_PATH_PROTOCOL_GUID;
 
    EFI_HANDLE     root_handle;
 
-   UINT32         disp_mode;
+   EFI_STATUS  Status;
 
-   boot_params*   params;
+   Status = gBS->HandleProtocol(gImageHandle, &loaded_dp_guid, (VOID**)&root_devpath);
+   if (EFI_ERROR(Status)) {
+      klog(LOG_ERR, L"loaded devicepath failed:%r\r\n", Status);
+      return Status;
+   }
 
-   GDTR     gdtr;
-   UINT64   tmp_cs;
-   UINT64   tmp_ds;
+   Status = gBS->LocateDevicePath(&gEfiSimpleFileSystemProtocolGuid, &root_devpath, &root_handle);
+   if (EFI_ERROR(Status)) {
+      klog(LOG_ERR, L"locate devicepath failed:%r\r\n", Status);
+      return Status;
+   }
 
-   UINTN    Key;
+   Status = gBS->HandleProtocol(root_handle, &gEfiSimpleFileSystemProtocolGuid, (VOID**)&fs);
+   if (EFI_ERROR(Status)) {
+      klog(LOG_ERR, L"simple file system not found:%r\r\n", Status);
+      return Status;
+   }
+
+   Status = fs->OpenVolume(fs, root);
+   if (EFI_ERROR(Status)) {
+      klog(LOG_ERR, L"Open Volume failed:%r\r\n", Status);
+      return Status;
+   }
+
+   return EFI_SUCCESS;
+}
+
+// Size of the memory map, with room for MEMMAP_SLACK more descriptors.
+//
+EFI_STATUS memmap_size(UINT64* size)
+{
+   UINTN    map_size;
+   UINTN    key;
+   UINTN    desc_size;
+   UINT32   desc_ver;
 
    EFI_STATUS  Status;
 
-   Status = gBS->HandleProtocol(gImageHandle, &loaded_dp_guid, (VOID**)&root_devpath);
+   map_size = 0;
+   Status = gBS->GetMemoryMap(&map_size, NULL, &key, &desc_size, &desc_ver);
+   if (Status != EFI_BUFFER_TOO_SMALL) {
+      return Status;
+   }
+
+   *size = map_size + MEMMAP_SLACK * desc_size;
+
+   return EFI_SUCCESS;
+}
+
+// Size of the file name plus extra bytes in front of it, for a plan item.
+//
+EFI_STATUS plan_file(EFI_FILE_PROTOCOL* root, CHAR16* name, UINT64 extra, UINT64* size)
+{
+   EFI_FILE_PROTOCOL*   file;
+
+   EFI_STATUS  Status;
+
+   Status = open_raw(root, name, &file);
+   if (!EFI_ERROR(Status)) {
+      Status = get_file_size(file, size);
+      file->Close(file);
+   }
    if (EFI_ERROR(Status)) {
-      Print(L"loaded devicepath failed:%r\r\n", Status);
+      klog(LOG_ERR, L"%s open failed:%r\r\n", name, Status);
       return Status;
    }
 
-   Status = gBS->LocateDevicePath(&gEfiSimpleFileSystemProtocolGuid, &root_devpath, &root_handle);
+   *size += extra;
+
+   return EFI_SUCCESS;
+}
+
+// Size every allocation of the boot from the kernel header and the file
+// sizes, and place all of them in one snapshot of the memory map before
+// any image is read. The loads take the reserved ranges by name.
+//
+EFI_STATUS plan_linux(EFI_FILE_PROTOCOL* root, boot_entry* entry)
+{
+   EFI_FILE_PROTOCOL*   file;
+   boot_params*   kernel;
+   plan_item      item[8];
+   UINTN          count;
+
+   EFI_STATUS  Status;
+
+   // init_memory_map fails without it, after everything is read
+   //
+   if (!FindRSDP()) {
+      klog(LOG_ERR, L"plan: no ACPI RSDP\r\n");
+      return EFI_NOT_FOUND;
+   }
+
+   kernel = malloc_pool(sizeof(boot_params));
+   if (!kernel) {
+      return EFI_OUT_OF_RESOURCES;
+   }
+   SetMem(kernel, sizeof(boot_params), 0);
+
+   Status = open_raw(root, entry->kernel, &file);
    if (EFI_ERROR(Status)) {
-      Print(L"locate devicepath failed:%r\r\n", Status);
+      free_pool(kernel);
+      klog(LOG_ERR, L"%s open failed:%r\r\n", entry->kernel, Status);
       return Status;
    }
 
-   Status = gBS->HandleProtocol(root_handle, &gEfiSimpleFileSystemProtocolGuid, (VOID**)&fs);
+   Status = load_kernel_header(kernel, file);
+   file->Close(file);
    if (EFI_ERROR(Status)) {
-      Print(L"simple file system not found:%r\r\n", Status);
+      free_pool(kernel);
+      klog(LOG_ERR, L"%s is not a linux kernel:%r\r\n", entry->kernel, Status);
       return Status;
    }
 
-   Status = fs->OpenVolume(fs, &root);
+   SetMem(item, sizeof(item), 0);
+   count = 0;
+
+   item[count].what = L"zeropage";
+   item[count].size = sizeof(boot_params);
+   item[count].limit = 0xffffffff;
+   ++count;
+
+   item[count].what = L"kernel";
+   item[count].size = kernel->hdr.init_size;
+   item[count].align = kernel->hdr.kernel_alignment;
+   item[count].limit = load_limit(&kernel->hdr);
+   if (!kernel->hdr.relocatable_kernel) {
+      item[count].addr = kernel->hdr.pref_address;
+   }
+   ++count;
+
+   item[count].what = L"cmdline";
+   item[count].size = kernel->hdr.cmdline_size + 1;
+   item[count].limit = load_limit(&kernel->hdr);
+   ++count;
+
+   item[count].what = L"initrd";
+   item[count].limit = initrd_limit(&kernel->hdr);
+   Status = plan_file(root, entry->initrd, 0, &item[count].size);
+   ++count;
+
+   if (!EFI_ERROR(Status) && entry->crash_kernel[0]) {
+      item[count].what = L"crash_kernel";
+      item[count].limit = MAX_UINT64;
+      Status = plan_file(root, entry->crash_kernel, sizeof(setup_data), &item[count].size);
+      ++count;
+   }
+
+   if (!EFI_ERROR(Status) && entry->crash_kernel[0] && entry->crash_initrd[0]) {
+      item[count].what = L"crash_initrd";
+      item[count].limit = MAX_UINT64;
+      Status = plan_file(root, entry->crash_initrd, sizeof(setup_data), &item[count].size);
+      ++count;
+   }
+
    if (EFI_ERROR(Status)) {
-      Print(L"Open Volume failed:%r\r\n", Status);
+      free_pool(kernel);
       return Status;
    }
 
-   params = init_zeropage();
-   if (!params) {
+   // the log as setup_data, at most the whole ring
+   //
+   item[count].what = L"log";
+   item[count].size = sizeof(setup_data) + LOG_RING_SIZE;
+   item[count].limit = MAX_UINT64;
+   ++count;
+
+   // the memory map as it is now, with the descriptors the planned and
+   // the later allocations may add
+   //
+   item[count].what = L"memmap";
+   item[count].limit = MAX_UINT64;
+   Status = memmap_size(&item[count].size);
+   ++count;
+   if (EFI_ERROR(Status)) {
+      free_pool(kernel);
+      return Status;
+   }
+
+   free_pool(kernel);
+
+   return plan_fit(item, count);
+}
+
+VOID lap(UINT64* ticks, UINTN phase, UINT64* t)
+{
+   UINT64 now;
+
+   if (!ticks) {
+      return;
+   }
+
+   now = AsmReadTsc();
+   ticks[phase] = now - *t;
+   *t = now;
+}
+
+// Everything boot_linux does before ExitBootServices.
+// When ticks is not NULL, the TSC ticks spent in each phase are stored in it.
+//
+EFI_STATUS prepare_linux(EFI_FILE_PROTOCOL* root, boot_entry* entry, boot_state* state, UINT64* ticks)
+{
+   UINT64   start;
+   UINT64   t;
+
+   EFI_STATUS  Status;
+
+   start = t = AsmReadTsc();
+
+   numa_init(FindRSDP());
+
+   Status = plan_linux(root, entry);
+   if (EFI_ERROR(Status)) {
+      klog(LOG_ERR, L"plan failed:%r\r\n", Status);
+      return Status;
+   }
+   lap(ticks, PHASE_PLAN, &t);
+
+   state->params = init_zeropage();
+   if (!state->params) {
+      plan_release();
       Status = EFI_OUT_OF_RESOURCES;
-      Print(L"init zeropage failed:%r\r\n", Status);
+      klog(LOG_ERR, L"init zeropage failed:%r\r\n", Status);
       return Status;
    }
 
-   Status = load_kernel(root, L"bzimage", params);
+   Status = load_kernel(root, entry->kernel, state->params);
    if (EFI_ERROR(Status)) {
-      release_zeropage(params);
-      Print(L"bzimage load failed:%r\r\n", Status);
+      release_zeropage(state->params);
+      klog(LOG_ERR, L"%s load failed:%r\r\n", entry->kernel, Status);
       return Status;
    }
+   lap(ticks, PHASE_KERNEL, &t);
 
-   Status = init_cmdline(root, L"config.txt", params);
+   Status = init_cmdline(root, entry->cmdline, state->params);
    if (EFI_ERROR(Status)) {
-      release_zeropage(params);
-      Print(L"config.txt load failed:%r\r\n", Status);
+      release_zeropage(state->params);
+      klog(LOG_ERR, L"%s load failed:%r\r\n", entry->cmdline, Status);
       return Status;
    }
+   lap(ticks, PHASE_CMDLINE, &t);
 
-   Status = load_initrd(root, L"initrd", params);
+   Status = load_initrd(root, entry->initrd, state->params);
    if (EFI_ERROR(Status)) {
-      release_zeropage(params);
-      Print(L"initrd load failed%r\r\n", Status);
+      release_zeropage(state->params);
+      klog(LOG_ERR, L"%s load failed:%r\r\n", entry->initrd, Status);
       return Status;
    }
+   lap(ticks, PHASE_INITRD, &t);
 
-   Status = setup_desc(&gdtr, &tmp_cs, &tmp_ds);
+   Status = load_crash(root, entry, state->params);
    if (EFI_ERROR(Status)) {
-      release_zeropage(params);
-      Print(L"setup desc failed%r\r\n", Status);
+      release_zeropage(state->params);
+      klog(LOG_ERR, L"%s load failed:%r\r\n", entry->crash_kernel, Status);
       return Status;
    }
-   //getchar();
+   lap(ticks, PHASE_CRASH, &t);
+
+   Status = setup_desc(&state->gdtr, &state->tmp_cs, &state->tmp_ds);
+   if (EFI_ERROR(Status)) {
+      release_zeropage(state->params);
+      klog(LOG_ERR, L"setup desc failed%r\r\n", Status);
+      return Status;
+   }
+   lap(ticks, PHASE_DESC, &t);
+
+   Status = setup_graphics(state->params, &state->disp_mode);
+   if (EFI_ERROR(Status)) {
+      release_desc(&state->gdtr);
+      release_zeropage(state->params);
+      klog(LOG_ERR, L"setup graphics failed:%r\r\n", Status);
+      return Status;
+   }
+   lap(ticks, PHASE_GRAPHICS, &t);
+
+   Status = attach_log(state->params);
+   if (EFI_ERROR(Status)) {
+      klog(LOG_WARN, L"attach log failed:%r\r\n", Status);
+   }
 
-   Status = setup_graphics(params, &disp_mode);
+   Status = init_memory_map(&state->Key, state->params);
    if (EFI_ERROR(Status)) {
-      release_desc(&gdtr);
-      release_zeropage(params);
-      Print(L"setup graphics failed:%r\r\n", Status);
+      release_desc(&state->gdtr);
+      release_zeropage(state->params);
+      restore_graphics(state->disp_mode);
+      klog(LOG_ERR, L"init memory map failed:%r\r\n", Status);
       return Status;
    }
+   lap(ticks, PHASE_MEMMAP, &t);
 
-   Status = init_memory_map(&Key, params);
+   if (ticks) {
+      ticks[PHASE_TOTAL] = t - start;
+   }
+
+   return EFI_SUCCESS;
+}
+
+VOID release_linux(boot_state* state)
+{
+   release_desc(&state->gdtr);
+   release_zeropage(state->params);
+   restore_graphics(state->disp_mode);
+}
+
+EFI_STATUS boot_linux(boot_entry* entry)
+{
+   EFI_FILE_PROTOCOL*   root;
+
+   boot_state  state;
+
+   EFI_STATUS  Status;
+
+   Status = open_root(&root);
    if (EFI_ERROR(Status)) {
-      release_desc(&gdtr);
-      release_zeropage(params);
-      restore_graphics(disp_mode);
-      Print(L"init memory map failed:%r\r\n", Status);
       return Status;
    }
 
-   Status = gBS->ExitBootServices(gImageHandle, Key);
+   Status = prepare_linux(root, entry, &state, NULL);
+   if (EFI_ERROR(Status)) {
+      save_log(root);
+      return Status;
+   }
+   //getchar();
+
+   Status = gBS->ExitBootServices(gImageHandle, state.Key);
+   if (EFI_ERROR(Status)) {
+      release_linux(&state);
+      klog(LOG_ERR, L"ExitBootServices failed:%r\r\n", Status);
+      save_log(root);
+      return Status;
+   }
+
+   _lgdt((UINT64)&state.gdtr);
+   chg_csds(state.tmp_cs, state.tmp_ds);
+   modify_gdt(&state.gdtr, 0x10, 0x18);
+
+   boot_lin64((UINT64)(state.params->hdr.pref_address + 0x200), (UINT64)state.params);
+
+   return EFI_SUCCESS;
+}
+
+#ifndef KLDR_BOOT_ONLY
+UINT64 tsc_khz(VOID)
+{
+   UINT64 t;
+
+   t = AsmReadTsc();
+   gBS->Stall(10000); // 10ms
+   t = AsmReadTsc() - t;
+
+   return t / 10;
+}
+
+UINT64 tsc_to_us(UINT64 ticks, UINT64 khz)
+{
+   if (!khz) {
+      return 0;
+   }
+
+   return ticks * 1000 / khz;
+}
+
+VOID sort_u64(UINT64* v, UINTN count)
+{
+   for (UINTN i = 1; i < count; ++i) {
+      UINT64 x = v[i];
+      UINTN  j = i;
+
+      while (j > 0 && v[j - 1] > x) {
+         v[j] = v[j - 1];
+         --j;
+      }
+      v[j] = x;
+   }
+}
+
+// Bytes of the crash kernel and initrd kept in setup_data.
+//
+UINT64 crash_bytes(boot_params* params)
+{
+   UINT64 ptr;
+   UINT64 bytes = 0;
+
+   for (ptr = params->hdr.setup_data; ptr; ptr = ((setup_data*)ptr)->next) {
+      setup_data* data = (setup_data*)ptr;
+
+      if (data->type == SETUP_KLDR_CRASH_KERNEL || data->type == SETUP_KLDR_CRASH_INITRD) {
+         bytes += data->len;
+      }
+   }
+
+   return bytes;
+}
+
+// Run the whole boot preparation count times without ExitBootServices,
+// releasing everything between iterations, and report the time per phase.
+//
+EFI_STATUS bench_linux(boot_entry* entry, UINTN count)
+{
+   CONST CHAR16* phase_name[PHASE_COUNT] = {
+      L"plan",
+      L"kernel",
+      L"cmdline",
+      L"initrd",
+      L"crash",
+      L"desc",
+      L"graphics",
+      L"memmap",
+      L"total"
+   };
+   CONST CHAR16* alloc_name[BENCH_ALLOCS] = {
+      L"pool",
+      L"pages",
+      L"KiB"
+   };
+
+   EFI_FILE_PROTOCOL*   root;
+
+   boot_state  state;
+   alloc_stat  first;
+   alloc_stat  before;
+   alloc_stat  after;
+
+   UINT64*  samples;
+   UINT64*  allocs;
+   UINT64*  column;
+   UINT64   file_bytes[PHASE_COUNT];
+   UINT64   khz;
+
+   EFI_STATUS  Status;
+
+   if (count == 0) {
+      count = BENCH_DEFAULT;
+   }
+   if (count > BENCH_MAX) {
+      count = BENCH_MAX;
+   }
+
+   Status = open_root(&root);
    if (EFI_ERROR(Status)) {
-      release_desc(&gdtr);
-      release_zeropage(params);
-      restore_graphics(disp_mode);
-      Print(L"ExitBootServices failed:%d\r\n", Status);
       return Status;
    }
 
-   _lgdt((UINT64)&gdtr);
-   chg_csds(tmp_cs, tmp_ds);
-   modify_gdt(&gdtr, 0x10, 0x18);
+   samples = malloc_pool(sizeof(UINT64) * PHASE_COUNT * count);
+   if (!samples) {
+      root->Close(root);
+      return EFI_OUT_OF_RESOURCES;
+   }
+   allocs = malloc_pool(sizeof(UINT64) * BENCH_ALLOCS * count);
+   if (!allocs) {
+      free_pool(samples);
+      root->Close(root);
+      return EFI_OUT_OF_RESOURCES;
+   }
+   column = malloc_pool(sizeof(UINT64) * count);
+   if (!column) {
+      free_pool(allocs);
+      free_pool(samples);
+      root->Close(root);
+      return EFI_OUT_OF_RESOURCES;
+   }
+
+   khz = tsc_khz();
+   Print(L"bench: %d iterations, TSC %ld kHz\r\n", count, khz);
+
+   SetMem(file_bytes, sizeof(file_bytes), 0);
+
+   CopyMem(&first, &alloc_count, sizeof(alloc_stat));
+
+   for (UINTN i = 0; i < count; ++i) {
+      UINT64* ticks = samples + i * PHASE_COUNT;
+
+      CopyMem(&before, &alloc_count, sizeof(alloc_stat));
+
+      Status = prepare_linux(root, entry, &state, ticks);
+      if (EFI_ERROR(Status)) {
+         Print(L"bench: iteration %d failed:%r\r\n", i, Status);
+         free_pool(column);
+         free_pool(allocs);
+         free_pool(samples);
+         root->Close(root);
+         return Status;
+      }
+
+      allocs[i * BENCH_ALLOCS + 0] = alloc_count.pool - before.pool;
+      allocs[i * BENCH_ALLOCS + 1] = alloc_count.pages - before.pages;
+      allocs[i * BENCH_ALLOCS + 2] = (alloc_count.page_bytes - before.page_bytes) / 1024;
+
+      file_bytes[PHASE_KERNEL] = (UINT64)state.params->hdr.syssize * 16;
+      file_bytes[PHASE_CMDLINE] = AsciiStrLen((CHAR8*)(UINTN)
+            (((UINT64)state.params->ext_cmd_line_ptr << 32) + state.params->hdr.cmd_line_ptr));
+      file_bytes[PHASE_INITRD] = ((UINT64)state.params->ext_ramdisk_size << 32)
+         + state.params->hdr.ramdisk_size;
+      file_bytes[PHASE_CRASH] = crash_bytes(state.params);
+
+      release_linux(&state);
+   }
+
+   CopyMem(&after, &alloc_count, sizeof(alloc_stat));
+
+   Print(L"\r\n%-10s %10s %10s %10s %12s\r\n", L"phase", L"min(us)", L"med(us)", L"max(us)", L"KiB/s");
+
+   for (UINTN p = 0; p < PHASE_COUNT; ++p) {
+      UINT64 med;
+
+      for (UINTN i = 0; i < count; ++i) {
+         column[i] = samples[i * PHASE_COUNT + p];
+      }
+      sort_u64(column, count);
+
+      med = tsc_to_us(column[count / 2], khz);
+
+      Print(L"%-10s %10ld %10ld %10ld",
+            phase_name[p],
+            tsc_to_us(column[0], khz),
+            med,
+            tsc_to_us(column[count - 1], khz));
+
+      if (file_bytes[p] && med) {
+         Print(L" %12ld", file_bytes[p] * 1000000 / 1024 / med);
+      }
+      Print(L"\r\n");
+   }
+
+   // per boot, as the times, so that the first boot is not hidden
+   //
+   Print(L"\r\n%-10s %10s %10s %10s\r\n", L"allocs", L"min", L"med", L"max");
 
-   boot_lin64((UINT64)(params->hdr.pref_address + 0x200), (UINT64)params);
+   for (UINTN a = 0; a < BENCH_ALLOCS; ++a) {
+      for (UINTN i = 0; i < count; ++i) {
+         column[i] = allocs[i * BENCH_ALLOCS + a];
+      }
+      sort_u64(column, count);
+
+      Print(L"%-10s %10ld %10ld %10ld\r\n",
+            alloc_name[a], column[0], column[count / 2], column[count - 1]);
+   }
+
+   Print(L"not released after %d boots: %d pool, %d pages\r\n",
+         count,
+         (after.pool - after.pool_free) - (first.pool - first.pool_free),
+         (after.pages - after.pages_free) - (first.pages - first.pages_free));
+
+   free_pool(column);
+   free_pool(allocs);
+   free_pool(samples);
+
+   root->Close(root);
 
    return EFI_SUCCESS;
 }
+#endif
 
 VOID* get_var(CHAR16* name, UINTN* size)
 {
@@ -1161,118 +2176,555 @@ VOID* get_var(CHAR16* name, UINTN* size)
    return ptr;
 }
 
+// Every variable write of the loader goes through here.
+// A write that would not change the variable is skipped and counted.
+//
+EFI_STATUS nv_write(CHAR16* name, EFI_GUID* guid, UINT32 attr, VOID* ptr, UINTN size)
+{
+   VOID*    cur;
+   UINTN    cur_size;
+   UINT32   cur_attr;
+
+   EFI_STATUS  Status;
+
+   cur = malloc_pool(size ? size : 1);
+   if (cur) {
+      cur_size = size;
+      Status = gRT->GetVariable(name, guid, &cur_attr, &cur_size, cur);
+
+      if (!EFI_ERROR(Status)
+       && cur_size == size
+       && cur_attr == attr
+       && CompareMem(cur, ptr, size) == 0) {
+         free_pool(cur);
+         ++nv_count.avoided;
+         klog(LOG_DEBUG, L"%s unchanged, not written\r\n", name);
+         return EFI_SUCCESS;
+      }
+      free_pool(cur);
+   }
+
+   Status = gRT->SetVariable(name, guid, attr, size, ptr);
+   if (EFI_ERROR(Status)) {
+      ++nv_count.failed;
+      klog(LOG_ERR, L"set %s failed:%r\r\n", name, Status);
+      return Status;
+   }
+   ++nv_count.written;
+
+   return EFI_SUCCESS;
+}
+
 EFI_STATUS set_var(CHAR16* name, VOID* ptr, UINTN size)
 {
+   return nv_write(
+         name,
+         &gEfiGlobalVariableGuid,
+         EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS,
+         ptr,
+         size);
+}
+
+UINT16* get_bootorder(UINTN* boot_order_size)
+{
+   UINT16* order;
+
+   order = get_var(L"BootOrder", boot_order_size);
+   if (!order) {
+      return 0;
+   }
+
+   *boot_order_size /= sizeof(UINT16);
+
+   return order;
+}
+
+EFI_STATUS set_bootorder(UINT16* boot_order, UINTN boot_order_size)
+{
+   EFI_STATUS  Status;
+
+   Status = set_var(L"BootOrder", boot_order, boot_order_size * sizeof(UINT16));
+
+   return Status;
+}
+
+#ifndef KLDR_BOOT_ONLY
+EFI_STATUS dump_bootoption(UINTN bootorder)
+{
+   CHAR16   varname[16];
+   UINTN    size;
+
+   EFI_LOAD_OPTION*  elo;
+
+   UnicodeSPrint(varname, sizeof(varname), L"Boot%04X", bootorder);
+   Print(L"%s : ", varname);
+
+   elo = get_var(varname, &size);
+   if (elo) {
+      Print(L"[%s]\r\n", (CHAR16*)((UINT8*)elo + sizeof(EFI_LOAD_OPTION)));
+
+      free_pool(elo);
+   }
+
+   return EFI_SUCCESS;
+}
+#endif
+
+EFI_STATUS get_var_word(CHAR16* name, UINT16* var)
+{
+   UINT32   attr;
+   UINTN    size = sizeof(UINT16);
+
+   EFI_STATUS  Status;
+
+   Status = gRT->GetVariable(name, &gEfiGlobalVariableGuid, &attr, &size, var);
+   if (EFI_ERROR(Status)) {
+      klog(LOG_WARN, L"get %s failed:%r\r\n", name, Status);
+      return Status;
+   }
+
+   if (size != sizeof(UINT16)) {
+      return EFI_NOT_FOUND;
+   }
+
+   return EFI_SUCCESS;
+}
+
+INTN find_order(UINT16* order, INTN count, UINTN n)
+{
+   for (INTN i = 0; i < count; ++i) {
+      if (order[i] == n) {
+         return i;
+      }
+   }
+
+   return -1;
+}
+
+VOID move_top(UINT16* order, INTN count, UINT16 n)
+{
+   INTN index;
+
+   index = find_order(order, count, n);
+   if (index == -1) {
+      return;
+   }
+
+   for (INTN i = index - 1; 0 <= i; --i) {
+      order[i + 1] = order[i];
+   }
+
+   order[0] = n;
+
+   return;
+}
+
+// Seconds since 1970-01-01 00:00, the time zone is ignored.
+//
+UINT64 efi_time_to_sec(EFI_TIME* t)
+{
+   INT64 y = t->Year;
+   INT64 m = t->Month;
+   INT64 days;
+
+   // days from civil
+   //
+   if (m <= 2) {
+      --y;
+      m += 12;
+   }
+   days = 365 * y + y / 4 - y / 100 + y / 400 + (153 * (m - 3) + 2) / 5 + t->Day - 719469;
+
+   return (UINT64)days * 86400 + t->Hour * 3600 + t->Minute * 60 + t->Second;
+}
+
+// Decide whether BootOrder may be rewritten now.
+// The time of the last rewrite is kept in a variable of the loader,
+// which is written only together with BootOrder.
+//
+BOOLEAN reorder_allowed(kldr_param* param, UINT64* now)
+{
+   EFI_TIME t;
+   UINT64   last;
+   UINTN    size;
+   UINT32   attr;
+
+   EFI_STATUS  Status;
+
+   *now = 0;
+
+   Status = gRT->GetTime(&t, NULL);
+   if (!EFI_ERROR(Status)) {
+      *now = efi_time_to_sec(&t);
+   }
+
+   if (param->reorder) {
+      return TRUE;
+   }
+
+   if (!param->reorder_interval || !*now) {
+      return FALSE;
+   }
+
+   size = sizeof(last);
+   Status = gRT->GetVariable(L"KldrReorderTime", &kldr_var_guid, &attr, &size, &last);
+   if (EFI_ERROR(Status) || size != sizeof(last)) {
+      return TRUE;
+   }
+
+   return (last > *now) || (*now - last >= param->reorder_interval);
+}
+
+// Move BootCurrent to the top of BootOrder.
+//
+EFI_STATUS reorder_boot_current(kldr_param* param)
+{
+   UINT16*  boot_order;
+   UINTN    boot_order_count;
+   UINT16   boot_current;
+   UINT64   now;
+
+   EFI_STATUS  Status;
+
+   boot_order = get_bootorder(&boot_order_count);
+   if (!boot_order) {
+      return EFI_NOT_FOUND;
+   }
+
+   Status = get_var_word(L"BootCurrent", &boot_current);
+   if (EFI_ERROR(Status) || boot_order[0] == boot_current) {
+      free_pool(boot_order);
+      return Status;
+   }
+
+   if (!reorder_allowed(param, &now)) {
+      free_pool(boot_order);
+      ++nv_count.avoided;
+      klog(LOG_INFO, L"Boot%04X is not first in BootOrder, not reordered\r\n", boot_current);
+      return EFI_SUCCESS;
+   }
+
+   move_top(boot_order, boot_order_count, boot_current);
+   Status = set_bootorder(boot_order, boot_order_count);
+   free_pool(boot_order);
+   if (EFI_ERROR(Status)) {
+      return Status;
+   }
+
+   if (now) {
+      nv_write(L"KldrReorderTime", &kldr_var_guid,
+            EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS,
+            &now, sizeof(now));
+   }
+
+   return EFI_SUCCESS;
+}
+
+BOOLEAN is_number(CHAR16* str)
+{
+   if (!*str) {
+      return FALSE;
+   }
+
+   while (*str) {
+      if (*str < L'0' || L'9' < *str) {
+         return FALSE;
+      }
+      ++str;
+   }
+
+   return TRUE;
+}
+
+// Copy the next field of the line to dst, or the rest of the line when rest is TRUE.
+//
+CHAR8* next_field(CHAR8* p, CHAR16* dst, UINTN max, BOOLEAN rest)
+{
+   UINTN i = 0;
+
+   while (*p == ' ' || *p == '\t') {
+      ++p;
+   }
+
+   while (*p && *p != '\n' && *p != '\r' && (rest || (*p != ' ' && *p != '\t'))) {
+      if (i < max - 1) {
+         dst[i++] = (CHAR16)(UINT8)*p;
+      }
+      ++p;
+   }
+   dst[i] = 0;
+
+   return p;
+}
+
+// Read entries.txt on the ESP. Each line is
+//    id  kernel  initrd  cmdline  description
+// and lines starting with '#' are comments.
+//
+EFI_STATUS read_entries(kldr_entry** entries, UINTN* count)
+{
+   EFI_FILE_PROTOCOL*   root;
+   EFI_FILE_PROTOCOL*   file;
+   kldr_entry* list;
+   CHAR8*   text;
+   CHAR8*   p;
+   UINT64   size;
+   UINTN    read;
+   UINTN    lines;
+   UINTN    line;
+
    EFI_STATUS  Status;
 
-   Status = gRT->SetVariable(
-         name,
-         &gEfiGlobalVariableGuid,
-         EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS,
-         size,
-         ptr);
+   Status = open_root(&root);
+   if (EFI_ERROR(Status)) {
+      return Status;
+   }
+
+   Status = root->Open(root, &file, KLDR_ENTRIES, EFI_FILE_MODE_READ, 0);
+   root->Close(root);
+   if (EFI_ERROR(Status)) {
+      return Status;
+   }
+
+   Status = get_file_size(file, &size);
+   if (EFI_ERROR(Status)) {
+      file->Close(file);
+      return Status;
+   }
+
+   text = malloc_pool(size + 1);
+   if (!text) {
+      file->Close(file);
+      return EFI_OUT_OF_RESOURCES;
+   }
+
+   read = size;
+   Status = file->Read(file, &read, text);
+   file->Close(file);
+   if (EFI_ERROR(Status)) {
+      free_pool(text);
+      return Status;
+   }
+   text[read] = 0;
+
+   lines = 1;
+   for (p = text; *p; ++p) {
+      lines += (*p == '\n');
+   }
+
+   list = malloc_pool(lines * sizeof(kldr_entry));
+   if (!list) {
+      free_pool(text);
+      return EFI_OUT_OF_RESOURCES;
+   }
+
+   *count = 0;
+   line = 0;
+   for (p = text; *p; ) {
+      kldr_entry* e = &list[*count];
+
+      ++line;
+      while (*p == ' ' || *p == '\t') {
+         ++p;
+      }
+
+      if (*p != '#' && *p != '\r' && *p != '\n' && *p) {
+         p = next_field(p, e->id, KLDR_ID_MAX, FALSE);
+         p = next_field(p, e->files.kernel, KLDR_PATH_MAX, FALSE);
+         p = next_field(p, e->files.initrd, KLDR_PATH_MAX, FALSE);
+         p = next_field(p, e->files.cmdline, KLDR_PATH_MAX, FALSE);
+         p = next_field(p, e->desc, KLDR_DESC_MAX, TRUE);
+
+         if (e->files.cmdline[0]) {
+            ++*count;
+         } else {
+            klog(LOG_WARN, L"%s line %d ignored\r\n", KLDR_ENTRIES, line);
+         }
+      }
+
+      while (*p && *p != '\n') {
+         ++p;
+      }
+      if (*p) {
+         ++p;
+      }
+   }
+   free_pool(text);
 
-   if (EFI_ERROR(Status)) {
-      Print(L"ERROR : %r\r\n", Status);
+   if (!*count) {
+      free_pool(list);
+      return EFI_NOT_FOUND;
    }
 
+   *entries = list;
+
    return EFI_SUCCESS;
 }
 
-UINT16* get_bootorder(UINTN* boot_order_size)
+// Take the files of the entry i of the list.
+// Only the first entry, the default one, may move itself to the top
+// of BootOrder; the others are usually booted once through BootNext.
+//
+VOID use_entry(kldr_entry* list, UINTN i, kldr_param* param)
 {
-   UINT16* order;
-
-   order = get_var(L"BootOrder", boot_order_size);
-   if (!order) {
-      return 0;
+   StrCpyS(param->entry.kernel, KLDR_PATH_MAX, list[i].files.kernel);
+   StrCpyS(param->entry.initrd, KLDR_PATH_MAX, list[i].files.initrd);
+   StrCpyS(param->entry.cmdline, KLDR_PATH_MAX, list[i].files.cmdline);
+   StrCpyS(param->entry_id, KLDR_ID_MAX, list[i].id);
+   if (i) {
+      param->chg_order = 0;
    }
 
-   *boot_order_size /= sizeof(UINT16);
-
-   return order;
+   klog(LOG_INFO, L"entry %s: %s %s %s\r\n", list[i].id,
+         param->entry.kernel, param->entry.initrd, param->entry.cmdline);
 }
 
-EFI_STATUS set_bootorder(UINT16* boot_order, UINTN boot_order_size)
+// Take the files of the entry from entries.txt.
+//
+EFI_STATUS select_entry(CHAR16* id, kldr_param* param)
 {
+   kldr_entry* list;
+   UINTN       count;
+
    EFI_STATUS  Status;
 
-   Status = set_var(L"BootOrder", boot_order, boot_order_size * sizeof(UINT16));
+   Status = read_entries(&list, &count);
+   if (EFI_ERROR(Status)) {
+      klog(LOG_ERR, L"%s:%r\r\n", KLDR_ENTRIES, Status);
+      return Status;
+   }
+
+   Status = EFI_NOT_FOUND;
+   for (UINTN i = 0; i < count; ++i) {
+      if (StrCmp(list[i].id, id) == 0) {
+         use_entry(list, i, param);
+         Status = EFI_SUCCESS;
+         break;
+      }
+   }
+   free_pool(list);
+
+   if (EFI_ERROR(Status)) {
+      klog(LOG_ERR, L"entry %s not found\r\n", id);
+   }
 
    return Status;
 }
 
-EFI_STATUS dump_bootoption(UINTN bootorder)
+VOID EFIAPI menu_print(CONST CHAR16* fmt, ...)
 {
-   CHAR16   varname[16];
-   UINTN    size;
-
-   EFI_LOAD_OPTION*  elo;
-
-   UnicodeSPrint(varname, sizeof(varname), L"Boot%04X", bootorder);
-   Print(L"%s : ", varname);
-
-   elo = get_var(varname, &size);
-   if (elo) {
-      Print(L"[%s]\r\n", (CHAR16*)((UINT8*)elo + sizeof(EFI_LOAD_OPTION)));
+   CHAR16   line[LOG_LINE_SIZE];
+   VA_LIST  args;
 
-      free_pool(elo);
-   }
+   VA_START(args, fmt);
+   UnicodeVSPrint(line, sizeof(line), fmt, args);
+   VA_END(args);
 
-   return EFI_SUCCESS;
+   gST->ConOut->OutputString(gST->ConOut, line);
 }
 
-EFI_STATUS get_var_word(CHAR16* name, UINT16* var)
+// Show the entries of entries.txt for "timeout=N" seconds.
+// The processor sleeps in WaitForEvent until a key or the one second
+// tick, and the current entry boots when nobody chooses another.
+// A key other than a digit or Enter stops the countdown.
+//
+EFI_STATUS boot_menu(kldr_param* param)
 {
-   UINT32   attr;
-   UINTN    size = sizeof(UINT16);
+   EFI_EVENT      events[2];
+   EFI_INPUT_KEY  key;
+   kldr_entry*    list;
+   UINTN    count;
+   UINTN    shown;
+   UINTN    left;
+   UINTN    index;
+   UINTN    choice;
+   BOOLEAN  counting;
 
    EFI_STATUS  Status;
 
-   Status = gRT->GetVariable(name, &gEfiGlobalVariableGuid, &attr, &size, var);
+   Status = read_entries(&list, &count);
    if (EFI_ERROR(Status)) {
-      Print(L"ERROR : %r\r\n", Status);
+      klog(LOG_WARN, L"menu: %s:%r\r\n", KLDR_ENTRIES, Status);
+      return Status;
    }
 
-   if (size != sizeof(UINT16)) {
-      return EFI_NOT_FOUND;
+   events[0] = gST->ConIn->WaitForKey;
+   Status = gBS->CreateEvent(EVT_TIMER, 0, NULL, NULL, &events[1]);
+   if (EFI_ERROR(Status)) {
+      free_pool(list);
+      return Status;
    }
 
-   return EFI_SUCCESS;
-}
+   Status = gBS->SetTimer(events[1], TimerPeriodic, 10 * 1000 * 1000);
+   if (EFI_ERROR(Status)) {
+      gBS->CloseEvent(events[1]);
+      free_pool(list);
+      return Status;
+   }
 
-INTN find_order(UINT16* order, INTN count, UINTN n)
-{
-   for (INTN i = 0; i < count; ++i) {
-      if (order[i] == n) {
-         return i;
-      }
+   shown = MIN(count, KLDR_MENU_MAX);
+   menu_print(L"\r\n");
+   for (UINTN i = 0; i < shown; ++i) {
+      menu_print(L" %d. %s\r\n", i + 1, list[i].desc[0] ? list[i].desc : list[i].id);
    }
+   menu_print(L"\r\n");
 
-   return -1;
-}
+   choice = count;
+   left = param->timeout;
+   counting = TRUE;
+   while (1) {
+      if (counting) {
+         menu_print(L"\rEnter or 1-%d, %s boots in %d s ", shown,
+               param->entry_id[0] ? param->entry_id : param->entry.kernel, left);
+      }
 
-VOID move_top(UINT16* order, INTN count, UINT16 n)
-{
-   INTN index;
+      Status = gBS->WaitForEvent(counting ? 2 : 1, events, &index);
+      if (EFI_ERROR(Status)) {
+         break;
+      }
 
-   index = find_order(order, count, n);
-   if (index == -1) {
-      return;
-   }
+      if (index == 1) {
+         if (--left == 0) {
+            break;
+         }
+         continue;
+      }
 
-   for (INTN i = index - 1; 0 <= i; --i) {
-      order[i + 1] = order[i];
+      Status = gST->ConIn->ReadKeyStroke(gST->ConIn, &key);
+      if (EFI_ERROR(Status)) {
+         continue;
+      }
+
+      if (key.UnicodeChar >= L'1' && key.UnicodeChar < L'1' + shown) {
+         choice = key.UnicodeChar - L'1';
+         break;
+      }
+      if (key.UnicodeChar == CHAR_CARRIAGE_RETURN) {
+         break;
+      }
+
+      if (counting) {
+         counting = FALSE;
+         gBS->SetTimer(events[1], TimerCancel, 0);
+         menu_print(L"\rEnter or 1-%d                                       ", shown);
+      }
    }
+   menu_print(L"\r\n");
 
-   order[0] = n;
+   gBS->SetTimer(events[1], TimerCancel, 0);
+   gBS->CloseEvent(events[1]);
 
-   return;
+   if (choice < count) {
+      use_entry(list, choice, param);
+   }
+   free_pool(list);
+
+   return EFI_SUCCESS;
 }
 
-EFI_STATUS get_param(UINTN* boot, UINTN* install, UINTN* chg_order)
+EFI_STATUS get_param(kldr_param* param)
 {
-   EFI_LOADED_IMAGE_PROTOCOL*       params;
+   EFI_LOADED_IMAGE_PROTOCOL*       li;
    EFI_UNICODE_COLLATION_PROTOCOL*  uc;
 
    EFI_GUID uc_guid = EFI_UNICODE_COLLATION_PROTOCOL2_GUID;
@@ -1285,7 +2737,7 @@ EFI_STATUS get_param(UINTN* boot, UINTN* install, UINTN* chg_order)
    Status = gBS->OpenProtocol(
          gImageHandle,
          &li_guid,
-         (VOID**)&params,
+         (VOID**)&li,
          gImageHandle,
          NULL,
          EFI_OPEN_PROTOCOL_GET_PROTOCOL);
@@ -1295,25 +2747,39 @@ EFI_STATUS get_param(UINTN* boot, UINTN* install, UINTN* chg_order)
    }
 
    // default behavior
-   *boot = 1;
-   *install = 0;
-   *chg_order = 1;
-
-   if (params->LoadOptionsSize) {
+   StrCpyS(param->entry.kernel, KLDR_PATH_MAX, L"bzimage");
+   StrCpyS(param->entry.initrd, KLDR_PATH_MAX, L"initrd");
+   StrCpyS(param->entry.cmdline, KLDR_PATH_MAX, L"config.txt");
+   param->entry.crash_kernel[0] = 0;
+   param->entry.crash_initrd[0] = 0;
+   param->entry.crash_size = CRASH_SIZE_DEFAULT;
+
+   param->boot = 1;
+   param->install = 0;
+   param->chg_order = 1;
+   param->reorder = 0;
+   param->reorder_interval = KLDR_REORDER_INTERVAL;
+   param->bench = 0;
+   param->cache = 0;
+   param->timeout = 0;
+   param->entry_id[0] = 0;
+
+   if (li->LoadOptionsSize) {
       CHAR16*  str;
       CHAR16*  p;
       CHAR16*  end;
+      BOOLEAN  bench_arg = FALSE;
 
-      str = malloc_pool(params->LoadOptionsSize / sizeof(CHAR16) + 1);
+      str = malloc_pool(li->LoadOptionsSize / sizeof(CHAR16) + 1);
       if (!str) {
          return EFI_OUT_OF_RESOURCES;
       }
 
-      CopyMem(str, params->LoadOptions, params->LoadOptionsSize);
-      str[params->LoadOptionsSize / sizeof(CHAR16)] = 0;
+      CopyMem(str, li->LoadOptions, li->LoadOptionsSize);
+      str[li->LoadOptionsSize / sizeof(CHAR16)] = 0;
 
       p = str;
-      end = p + params->LoadOptionsSize / sizeof(CHAR16);
+      end = p + li->LoadOptionsSize / sizeof(CHAR16);
       while (p < end) {
          CHAR16* n;
          while ((*p == L' ') || (*p == L'\t')) {
@@ -1324,24 +2790,64 @@ EFI_STATUS get_param(UINTN* boot, UINTN* install, UINTN* chg_order)
          }
          n = p;
          while (*n) {
-            if ((*n == L' ') || (*p == L'\t')) {
+            if ((*n == L' ') || (*n == L'\t')) {
                *n = 0;
                break;
             }
             ++n;
          }
          //Print(L"[%s]\r\n", p);
-         if (uc->StriColl(uc, p, L"kldr.efi") == 0) {
-            *boot = 0;
-            *chg_order = 0;
+         if (bench_arg && is_number(p)) {
+            param->bench = StrDecimalToUintn(p);
+         } else if (uc->StriColl(uc, p, L"kldr.efi") == 0) {
+            param->boot = 0;
+            param->chg_order = 0;
          } else if (uc->StriColl(uc, p, L"install") == 0) {
-            *install = 1;
+            param->install = 1;
          } else if (uc->StriColl(uc, p, L"boot") == 0) {
-            *boot = 1;
+            param->boot = 1;
+         } else if (uc->StriColl(uc, p, L"bench") == 0) {
+            param->bench = BENCH_DEFAULT;
+         } else if (StrnCmp(p, L"loglevel=", 9) == 0 && is_number(p + 9)) {
+            kmsg.level = StrDecimalToUintn(p + 9);
+         } else if (uc->StriColl(uc, p, L"verbose") == 0) {
+            kmsg.level = LOG_DEBUG;
+         } else if (uc->StriColl(uc, p, L"reorder") == 0) {
+            param->reorder = 1;
+            param->chg_order = 1;
+         } else if (StrnCmp(p, L"reorder_interval=", 17) == 0 && is_number(p + 17)) {
+            param->reorder_interval = StrDecimalToUintn(p + 17);
+         } else if (StrnCmp(p, L"cache=", 6) == 0 && is_number(p + 6)) {
+            param->cache = StrDecimalToUintn(p + 6);
+         } else if (StrnCmp(p, L"timeout=", 8) == 0 && is_number(p + 8)) {
+            param->timeout = StrDecimalToUintn(p + 8);
+         } else if (uc->MetaiMatch(uc, p, L"entry=*")) {
+            Status = select_entry(p + 6, param);
+            if (EFI_ERROR(Status)) {
+               break;
+            }
+         } else if (StrnCmp(p, L"kernel=", 7) == 0) {
+            StrnCpyS(param->entry.kernel, KLDR_PATH_MAX, p + 7, KLDR_PATH_MAX - 1);
+         } else if (StrnCmp(p, L"initrd=", 7) == 0) {
+            StrnCpyS(param->entry.initrd, KLDR_PATH_MAX, p + 7, KLDR_PATH_MAX - 1);
+         } else if (StrnCmp(p, L"cmdline=", 8) == 0) {
+            StrnCpyS(param->entry.cmdline, KLDR_PATH_MAX, p + 8, KLDR_PATH_MAX - 1);
+         } else if (StrnCmp(p, L"crash_kernel=", 13) == 0) {
+            StrnCpyS(param->entry.crash_kernel, KLDR_PATH_MAX, p + 13, KLDR_PATH_MAX - 1);
+         } else if (StrnCmp(p, L"crash_initrd=", 13) == 0) {
+            StrnCpyS(param->entry.crash_initrd, KLDR_PATH_MAX, p + 13, KLDR_PATH_MAX - 1);
+         } else if (StrnCmp(p, L"crash_size=", 11) == 0 && is_number(p + 11)) {
+            param->entry.crash_size = StrDecimalToUintn(p + 11);
          }
+         bench_arg = (uc->StriColl(uc, p, L"bench") == 0);
          p = n + 1;
       }
       free_pool(str);
+
+      if (EFI_ERROR(Status)) {
+         gBS->CloseProtocol(gImageHandle, &li_guid, gImageHandle, NULL);
+         return Status;
+      }
    }
 
    Status = gBS->CloseProtocol(gImageHandle, &li_guid, gImageHandle, NULL);
@@ -1352,6 +2858,7 @@ EFI_STATUS get_param(UINTN* boot, UINTN* install, UINTN* chg_order)
    return Status;
 }
 
+#ifndef KLDR_BOOT_ONLY
 EFI_STATUS assign_order(UINT16* norder)
 {
    for (INTN order = 0; order < 0x10000; ++order) {
@@ -1495,8 +3002,10 @@ EFI_STATUS add_boot_order(UINT16 order)
 
    free_pool(cur_order);
 
-   new_order[boot_order_count] = order;
-   ++boot_order_count;
+   if (find_order(new_order, boot_order_count, order) == -1) {
+      new_order[boot_order_count] = order;
+      ++boot_order_count;
+   }
 
    move_top(new_order, boot_order_count, order);
    Status = set_bootorder(new_order, boot_order_count);
@@ -1539,7 +3048,162 @@ EFI_STATUS get_max_size(UINT64* size)
    return Status;
 }
 
-EFI_STATUS install_boot_order(const CHAR16* desc, VOID* opt_data, UINTN opt_size)
+// When the load option var starts this file path, copy the id of its
+// "entry=<id>" OptionalData to id ("" for none) and return TRUE.
+//
+BOOLEAN option_id(UINT8* var, UINTN size, VOID* dp, UINTN dp_size, CHAR16* id, UINTN id_max)
+{
+   EFI_LOAD_OPTION*  elo = (EFI_LOAD_OPTION*)var;
+   CHAR16*  opt;
+   UINTN    desc_size;
+   UINTN    opt_len;
+   UINTN    i;
+
+   if (size < sizeof(EFI_LOAD_OPTION) || elo->FilePathListLength != dp_size) {
+      return FALSE;
+   }
+
+   desc_size = 0;
+   for (i = sizeof(EFI_LOAD_OPTION); i + sizeof(CHAR16) <= size; i += sizeof(CHAR16)) {
+      if (*(CHAR16*)(var + i) == 0) {
+         desc_size = i + sizeof(CHAR16) - sizeof(EFI_LOAD_OPTION);
+         break;
+      }
+   }
+   if (!desc_size || sizeof(EFI_LOAD_OPTION) + desc_size + dp_size > size) {
+      return FALSE;
+   }
+   if (CompareMem(var + sizeof(EFI_LOAD_OPTION) + desc_size, dp, dp_size) != 0) {
+      return FALSE;
+   }
+
+   opt = (CHAR16*)(var + sizeof(EFI_LOAD_OPTION) + desc_size + dp_size);
+   opt_len = (size - sizeof(EFI_LOAD_OPTION) - desc_size - dp_size) / sizeof(CHAR16);
+
+   id[0] = 0;
+   if (opt_len > 6 && StrnCmp(opt, L"entry=", 6) == 0) {
+      for (i = 0; i + 6 < opt_len && i + 1 < id_max; ++i) {
+         if (opt[i + 6] == 0 || opt[i + 6] == L' ') {
+            break;
+         }
+         id[i] = opt[i + 6];
+      }
+      id[i] = 0;
+   }
+
+   return TRUE;
+}
+
+// Find the Boot#### in BootOrder of this file path and entry id,
+// whatever its description, attributes and other options are.
+//
+EFI_STATUS find_boot_option(VOID* dp, UINTN dp_size, CONST CHAR16* id, UINT16* order)
+{
+   UINT16*  boot_order;
+   UINTN    boot_order_count;
+   CHAR16   var_id[KLDR_ID_MAX];
+
+   EFI_STATUS  Status;
+
+   boot_order = get_bootorder(&boot_order_count);
+   if (!boot_order) {
+      return EFI_NOT_FOUND;
+   }
+
+   Status = EFI_NOT_FOUND;
+   for (UINTN i = 0; i < boot_order_count; ++i) {
+      CHAR16   varname[16];
+      UINTN    size;
+      VOID*    var;
+
+      UnicodeSPrint(varname, sizeof(varname), L"Boot%04X", boot_order[i]);
+
+      var = get_var(varname, &size);
+      if (!var) {
+         continue;
+      }
+
+      if (option_id(var, size, dp, dp_size, var_id, KLDR_ID_MAX) && StrCmp(var_id, id) == 0) {
+         *order = boot_order[i];
+         Status = EFI_SUCCESS;
+      }
+      free_pool(var);
+
+      if (!EFI_ERROR(Status)) {
+         break;
+      }
+   }
+   free_pool(boot_order);
+
+   return Status;
+}
+
+// Remove the Boot#### of this Kldr.efi with an "entry=<id>" that is
+// not in keep from NVRAM and BootOrder: entries gone from entries.txt,
+// and the copies older installs left.
+//
+EFI_STATUS remove_boot_options(UINT16* keep, UINTN keep_count)
+{
+   UINT16*  boot_order;
+   UINTN    boot_order_count;
+   UINTN    n;
+   VOID*    dp;
+   UINTN    dp_size;
+   CHAR16   var_id[KLDR_ID_MAX];
+
+   EFI_STATUS  Status;
+
+   dp = get_media_dp(&dp_size);
+   if (!dp) {
+      return EFI_OUT_OF_RESOURCES;
+   }
+
+   boot_order = get_bootorder(&boot_order_count);
+   if (!boot_order) {
+      free_pool(dp);
+      return EFI_NOT_FOUND;
+   }
+
+   n = 0;
+   for (UINTN i = 0; i < boot_order_count; ++i) {
+      CHAR16   varname[16];
+      UINTN    size;
+      VOID*    var;
+      BOOLEAN  stale = FALSE;
+
+      UnicodeSPrint(varname, sizeof(varname), L"Boot%04X", boot_order[i]);
+
+      var = get_var(varname, &size);
+      if (var) {
+         stale = option_id(var, size, dp, dp_size, var_id, KLDR_ID_MAX)
+               && var_id[0]
+               && find_order(keep, keep_count, boot_order[i]) == -1;
+         free_pool(var);
+      }
+
+      if (stale) {
+         Print(L"remove %s [%s]\r\n", varname, var_id);
+         set_var(varname, NULL, 0);
+      } else {
+         boot_order[n++] = boot_order[i];
+      }
+   }
+
+   Status = EFI_SUCCESS;
+   if (n != boot_order_count) {
+      Status = set_bootorder(boot_order, n);
+   }
+
+   free_pool(boot_order);
+   free_pool(dp);
+
+   return Status;
+}
+
+// Install the load option of the entry id ("" for the default files),
+// updating its Boot#### in place when there is one.
+//
+EFI_STATUS install_boot_order(const CHAR16* desc, VOID* opt_data, UINTN opt_size, CONST CHAR16* id, UINT16* installed)
 {
    UINT16   order;
    CHAR16   varname[16];
@@ -1559,12 +3223,6 @@ EFI_STATUS install_boot_order(const CHAR16* desc, VOID* opt_data, UINTN opt_size
       return 0;
    }
 
-   Status = assign_order(&order);
-   if (EFI_ERROR(Status)) {
-      return Status;
-   }
-   UnicodeSPrint(varname, sizeof(varname), L"Boot%04X", order);
-
    desc_size = StrSize(desc);
    dp = get_media_dp(&dp_size);
    if (!dp) {
@@ -1585,6 +3243,7 @@ EFI_STATUS install_boot_order(const CHAR16* desc, VOID* opt_data, UINTN opt_size
 
    var = malloc_pool(size);
    if (!var) {
+      free_pool(dp);
       return EFI_OUT_OF_RESOURCES;
    }
 
@@ -1603,15 +3262,27 @@ EFI_STATUS install_boot_order(const CHAR16* desc, VOID* opt_data, UINTN opt_size
    if (opt_data) {
       CopyMem(var + sizeof(EFI_LOAD_OPTION) + desc_size + dp_size, opt_data, opt_size);
    }
+
+   // installing again reuses the same Boot####, nv_write skips it
+   // when nothing changed
+   //
+   Status = find_boot_option(dp, dp_size, id, &order);
    free_pool(dp);
+   if (EFI_ERROR(Status)) {
+      Status = assign_order(&order);
+      if (EFI_ERROR(Status)) {
+         free_pool(var);
+         return Status;
+      }
+   }
+   UnicodeSPrint(varname, sizeof(varname), L"Boot%04X", order);
 
    Status = set_var(varname, var, size);
+   free_pool(var);
    if (EFI_ERROR(Status)) {
-      free_pool(var);
       return Status;
    }
-
-   free_pool(var);
+   *installed = order;
 
    Status = add_boot_order(order);
    if (EFI_ERROR(Status)) {
@@ -1621,13 +3292,77 @@ EFI_STATUS install_boot_order(const CHAR16* desc, VOID* opt_data, UINTN opt_size
    return Status;
 }
 
+// One Boot#### per line of entries.txt, with "entry=<id>" as OptionalData,
+// or a single one for the default files when there is no entries.txt.
+//
+EFI_STATUS install_entries(UINTN timeout)
+{
+   kldr_entry* list;
+   UINTN       count;
+   CHAR16      desc[KLDR_DESC_MAX + 8];
+   CHAR16      opt[KLDR_ID_MAX + 32];
+   UINT16*     keep;
+
+   EFI_STATUS  Status;
+
+   Status = read_entries(&list, &count);
+   if (Status == EFI_NOT_FOUND) {
+      UINT16 order;
+
+      Status = install_boot_order(L"Kldr - linux kernel loader", NULL, 0, L"", &order);
+      if (EFI_ERROR(Status)) {
+         return Status;
+      }
+      return remove_boot_options(NULL, 0);
+   }
+   if (EFI_ERROR(Status)) {
+      return Status;
+   }
+
+   keep = malloc_pool(count * sizeof(UINT16));
+   if (!keep) {
+      free_pool(list);
+      return EFI_OUT_OF_RESOURCES;
+   }
+
+   // backwards, so that the first entry ends up first in BootOrder
+   //
+   for (UINTN i = count; i > 0; --i) {
+      kldr_entry* e = &list[i - 1];
+
+      UnicodeSPrint(desc, sizeof(desc), L"Kldr - %s", e->desc[0] ? e->desc : e->id);
+      // the default entry shows the menu when "timeout=N" is installed
+      //
+      if (i == 1 && timeout) {
+         UnicodeSPrint(opt, sizeof(opt), L"entry=%s timeout=%d", e->id, timeout);
+      } else {
+         UnicodeSPrint(opt, sizeof(opt), L"entry=%s", e->id);
+      }
+
+      Status = install_boot_order(desc, opt, StrSize(opt), e->id, &keep[i - 1]);
+      if (EFI_ERROR(Status)) {
+         break;
+      }
+   }
+
+   // only after every entry is in place
+   //
+   if (!EFI_ERROR(Status)) {
+      Status = remove_boot_options(keep, count);
+   }
+
+   free_pool(keep);
+   free_pool(list);
+
+   return Status;
+}
+#endif
+
 EFI_STATUS EFIAPI UefiMain(
       IN EFI_HANDLE ImageHandle,
       IN EFI_SYSTEM_TABLE* SystemTable)
 {
-   UINTN boot = 0;
-   UINTN install = 0;
-   UINTN chg_order = 0;
+   kldr_param  param;
 
    EFI_STATUS  Status;
 
@@ -1636,46 +3371,56 @@ EFI_STATUS EFIAPI UefiMain(
    //gBS = gST->BootServices;
    //gRT = gST->RuntimeServices;
 
-   Status = get_param(&boot, &install, &chg_order);
+   log_init();
+
+   Status = get_param(&param);
    if (EFI_ERROR(Status)) {
-      Print(L"%r\r\n", Status);
+      klog(LOG_ERR, L"%r\r\n", Status);
       return Status;
    }
 
-   if (install) {
+   if (param.cache) {
+      cache_init((UINT64)param.cache << 20);
+   }
+
+#ifndef KLDR_BOOT_ONLY
+   if (param.bench) {
+      return bench_linux(&param.entry, param.bench);
+   }
+
+   if (param.install) {
       Print(L"install\r\n");
-      Status = install_boot_order(L"Kldr - linux kernel loader", NULL, 0);
+      Status = install_entries(param.timeout);
       if (EFI_ERROR(Status)) {
          Print(L"install error:%r\r\n", Status);
          return Status;
       }
    }
+#else
+   if (param.bench || param.install) {
+      klog(LOG_ERR, L"bench and install are not in the boot-only build\r\n");
+      return EFI_UNSUPPORTED;
+   }
+#endif
 
-   if (boot) {
-
-      if (chg_order) {
-         UINT16*  boot_order;
-         UINTN    boot_order_count;
-
-         boot_order = get_bootorder(&boot_order_count);
+   if (param.boot) {
 
-         if (boot_order) {
-            UINT16 boot_current;
+      // nothing is read or waited for without "timeout=N"
+      //
+      if (param.timeout) {
+         boot_menu(&param);
+      }
 
-            Status = get_var_word(L"BootCurrent", &boot_current);
-            if (!EFI_ERROR(Status)) {
-               if (boot_order[0] != boot_current) {
-                  move_top(boot_order, boot_order_count, boot_current);
-                  set_bootorder(boot_order, boot_order_count);
-               }
-            }
-            free_pool(boot_order);
-         }
+      if (param.chg_order) {
+         reorder_boot_current(&param);
       }
 
-      Status = boot_linux();
+      klog(LOG_INFO, L"nvram: %d written, %d avoided, %d failed\r\n",
+            nv_count.written, nv_count.avoided, nv_count.failed);
+
+      Status = boot_linux(&param.entry);
       if (EFI_ERROR(Status)) {
-         Print(L"linux boot failed\r\n");
+         klog(LOG_ERR, L"linux boot failed\r\n");
          return Status;
       }
    }
@@ -0,0 +1,71 @@
+/*
+ * Declarations shared by the loader modules.
+ *
+ * Copyright (c) 2022 norisio.dev
+ *
+ * SPDX short identifier: MIT
+ *
+ */
+
+#ifndef KLDR_H_
+#define KLDR_H_
+
+#include <Uefi.h>
+#include <Protocol/SimpleFileSystem.h>
+
+#define LOG_ERR         0
+#define LOG_WARN        1
+#define LOG_INFO        2
+#define LOG_DEBUG       3
+
+#define NUMA_NO_NODE    0xffffffff
+
+// One allocation of the boot, see plan_fit.
+// limit is the last usable address, MAX_UINT64 for none.
+// addr is the address to check when set, otherwise the chosen one.
+// Items are matched by what in plan_take.
+//
+typedef struct {
+   CONST CHAR16*  what;
+   UINT64   size;
+   UINT64   align;
+   UINT64   limit;
+   UINT64   addr;
+} plan_item;
+
+#define KLDR_VARIABLE_GUID \
+   { 0xf2d34094, 0xd1d5, 0x44a9, { 0xb2, 0x7c, 0x75, 0xef, 0x32, 0x69, 0xf8, 0xe4 } }
+
+// Kldr.c
+//
+VOID* malloc_pool(UINTN size);
+VOID free_pool(VOID* ptr);
+VOID* malloc_pages_at(UINT64 size, EFI_PHYSICAL_ADDRESS addr);
+VOID free_pages(VOID* ptr, UINT64 size);
+VOID EFIAPI klog(UINTN level, CONST CHAR16* fmt, ...);
+EFI_STATUS nv_write(CHAR16* name, EFI_GUID* guid, UINT32 attr, VOID* ptr, UINTN size);
+
+// ext4.c
+//
+BOOLEAN ext4_source(CONST CHAR16* source);
+EFI_STATUS ext4_open(CONST CHAR16* source, EFI_FILE_PROTOCOL** file);
+
+// numa.c
+//
+EFI_STATUS numa_init(UINT64 rsdp);
+UINT32 numa_node(UINT64 addr);
+EFI_STATUS numa_find(UINT64 size, UINT64 align, UINT64 limit, EFI_PHYSICAL_ADDRESS* addr);
+BOOLEAN numa_local(UINT64 base, UINT64 size);
+
+// cache.c
+//
+EFI_STATUS cache_init(UINT64 size);
+EFI_STATUS cache_open(CONST CHAR16* name, EFI_FILE_PROTOCOL** file);
+
+// plan.c
+//
+EFI_STATUS plan_fit(plan_item* items, UINTN count);
+VOID* plan_take(CONST CHAR16* what, UINT64 size);
+VOID plan_release(VOID);
+
+#endif
@@ -0,0 +1,573 @@
+/*
+ * Copy of the loaded files kept in reserved memory across warm resets.
+ *
+ * Copyright (c) 2022 norisio.dev
+ *
+ * SPDX short identifier: MIT
+ *
+ */
+
+#include <Uefi.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/UefiRuntimeServicesTableLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/BaseLib.h>
+#include <Library/SynchronizationLib.h>
+#include <Protocol/MpService.h>
+#include <Guid/FileInfo.h>
+
+#include "Kldr.h"
+
+#define CACHE_MAGIC        0x4843414352444c4bULL   // "KLDRCACH"
+#define CACHE_VERSION      1
+#define CACHE_ENTRIES      8
+#define CACHE_NAME_MAX     256
+#define CACHE_CHUNK        (4 * 1024 * 1024)
+#define CACHE_VARIABLE     L"KldrCache"
+
+// One cached file. The data is at offset from the start of the region.
+//
+typedef struct {
+   CHAR16   name[CACHE_NAME_MAX];
+   UINT64   offset;
+   UINT64   size;
+   EFI_TIME mtime;
+   UINT32   digest;
+   UINT32   _rsvd;
+} cache_entry;
+
+// At the start of the region, followed by the data.
+// crc covers the header with crc set to 0.
+//
+typedef struct {
+   UINT64      magic;
+   UINT32      version;
+   UINT32      crc;
+   UINT64      base;
+   UINT64      size;
+   cache_entry entry[CACHE_ENTRIES];
+} cache_header;
+
+#define CACHE_DATA         ((sizeof(cache_header) + EFI_PAGE_SIZE - 1) & ~(UINT64)(EFI_PAGE_SIZE - 1))
+
+// Where the region is, kept in a variable of the loader.
+//
+typedef struct {
+   UINT64   base;
+   UINT64   size;
+} cache_location;
+
+// An open copy. The data is found from entry on every read,
+// cache_space may move it while the file is open.
+//
+typedef struct {
+   EFI_FILE_PROTOCOL file;
+
+   cache_entry*   entry;
+   UINT64         pos;
+} cache_file;
+
+typedef struct {
+   UINT8*   data;
+   UINT64   size;
+   UINT32*  crc;
+   UINTN    chunks;
+
+   volatile UINT32 next;
+} digest_job;
+
+static cache_header* cache;
+static EFI_GUID      cache_var_guid = KLDR_VARIABLE_GUID;
+
+// Runs on the BSP and the APs, so it must not call boot services.
+//
+VOID EFIAPI digest_worker(VOID* arg)
+{
+   digest_job* job = arg;
+   UINTN       i;
+
+   while ((i = InterlockedIncrement(&job->next) - 1) < job->chunks) {
+      UINT64 offset = (UINT64)i * CACHE_CHUNK;
+
+      job->crc[i] = CalculateCrc32(job->data + offset, (UINTN)MIN(CACHE_CHUNK, job->size - offset));
+   }
+}
+
+// CRC32 of each 4MB chunk, then of the chunk CRCs.
+// The chunks are shared with the APs when MP services are there,
+// so the result does not depend on the number of processors.
+//
+UINT32 cache_digest(VOID* data, UINT64 size)
+{
+   EFI_MP_SERVICES_PROTOCOL*  mp;
+   EFI_EVENT   done;
+   digest_job  job;
+   UINT32      digest;
+   UINTN       index;
+   BOOLEAN     started;
+
+   EFI_STATUS  Status;
+
+   job.data = data;
+   job.size = size;
+   job.chunks = (UINTN)((size + CACHE_CHUNK - 1) / CACHE_CHUNK);
+   job.next = 0;
+
+   job.crc = malloc_pool(job.chunks * sizeof(UINT32) + 1);
+   if (!job.crc) {
+      return CalculateCrc32(data, (UINTN)size);
+   }
+
+   started = FALSE;
+   done = NULL;
+   if (job.chunks > 1) {
+      Status = gBS->LocateProtocol(&gEfiMpServiceProtocolGuid, NULL, (VOID**)&mp);
+      if (!EFI_ERROR(Status)) {
+         Status = gBS->CreateEvent(0, TPL_CALLBACK, NULL, NULL, &done);
+      }
+      if (!EFI_ERROR(Status)) {
+         Status = mp->StartupAllAPs(mp, digest_worker, FALSE, done, 0, &job, NULL);
+         started = !EFI_ERROR(Status);
+      }
+   }
+
+   digest_worker(&job);
+
+   if (started) {
+      gBS->WaitForEvent(1, &done, &index);
+   }
+   if (done) {
+      gBS->CloseEvent(done);
+   }
+
+   digest = CalculateCrc32(job.crc, job.chunks * sizeof(UINT32));
+   free_pool(job.crc);
+
+   return digest;
+}
+
+VOID cache_seal(VOID)
+{
+   cache->crc = 0;
+   cache->crc = CalculateCrc32(cache, sizeof(cache_header));
+
+   // a warm reset does not write back the processor caches
+   //
+   AsmWbinvd();
+}
+
+VOID cache_reset(EFI_PHYSICAL_ADDRESS base, UINT64 size)
+{
+   SetMem(cache, sizeof(cache_header), 0);
+   cache->magic = CACHE_MAGIC;
+   cache->version = CACHE_VERSION;
+   cache->base = base;
+   cache->size = size;
+   cache_seal();
+}
+
+BOOLEAN cache_valid(EFI_PHYSICAL_ADDRESS base, UINT64 size)
+{
+   UINT32 crc;
+
+   if (cache->magic != CACHE_MAGIC
+    || cache->version != CACHE_VERSION
+    || cache->base != base
+    || cache->size != size) {
+      return FALSE;
+   }
+
+   crc = cache->crc;
+   cache->crc = 0;
+   cache->crc = CalculateCrc32(cache, sizeof(cache_header));
+
+   return cache->crc == crc;
+}
+
+// Reserve the region of size bytes at the same address as the last boot,
+// so what a warm reset left there can be used.
+// The region is EfiReservedMemoryType, the kernel does not touch it.
+//
+EFI_STATUS cache_init(UINT64 size)
+{
+   cache_location loc;
+   EFI_PHYSICAL_ADDRESS base;
+   UINTN    var_size;
+   UINT32   attr;
+   UINTN    pages;
+
+   EFI_STATUS  Status;
+
+   size = (size + EFI_PAGE_SIZE - 1) & ~(UINT64)(EFI_PAGE_SIZE - 1);
+   if (size <= CACHE_DATA) {
+      return EFI_INVALID_PARAMETER;
+   }
+   pages = EFI_SIZE_TO_PAGES(size);
+
+   var_size = sizeof(loc);
+   Status = gRT->GetVariable(CACHE_VARIABLE, &cache_var_guid, &attr, &var_size, &loc);
+   if (!EFI_ERROR(Status) && var_size == sizeof(loc) && loc.size == size) {
+      base = loc.base;
+      Status = gBS->AllocatePages(AllocateAddress, EfiReservedMemoryType, pages, &base);
+      if (!EFI_ERROR(Status)) {
+         cache = (cache_header*)base;
+         if (cache_valid(base, size)) {
+            klog(LOG_INFO, L"cache: %ld MB at %lx\r\n", size >> 20, base);
+            return EFI_SUCCESS;
+         }
+
+         klog(LOG_INFO, L"cache: no valid cache at %lx\r\n", base);
+         cache_reset(base, size);
+         return EFI_SUCCESS;
+      }
+
+      klog(LOG_WARN, L"cache: %lx is in use:%r\r\n", loc.base, Status);
+   }
+
+   Status = gBS->AllocatePages(AllocateAnyPages, EfiReservedMemoryType, pages, &base);
+   if (EFI_ERROR(Status)) {
+      klog(LOG_ERR, L"cache: cannot reserve %ld MB:%r\r\n", size >> 20, Status);
+      return Status;
+   }
+
+   cache = (cache_header*)base;
+   cache_reset(base, size);
+
+   loc.base = base;
+   loc.size = size;
+   Status = nv_write(CACHE_VARIABLE, &cache_var_guid,
+         EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS,
+         &loc, sizeof(loc));
+   if (EFI_ERROR(Status)) {
+      gBS->FreePages(base, pages);
+      cache = NULL;
+      return Status;
+   }
+
+   klog(LOG_INFO, L"cache: %ld MB at %lx, new\r\n", size >> 20, base);
+
+   return EFI_SUCCESS;
+}
+
+// Offset of a free area of size bytes, packing the entries toward
+// the start of the region when the end has no room.
+//
+EFI_STATUS cache_space(UINT64 size, UINT64* offset)
+{
+   UINT64 end;
+
+   end = CACHE_DATA;
+   for (UINTN i = 0; i < CACHE_ENTRIES; ++i) {
+      if (cache->entry[i].name[0]) {
+         end = MAX(end, cache->entry[i].offset + cache->entry[i].size);
+      }
+   }
+   end = (end + EFI_PAGE_SIZE - 1) & ~(UINT64)(EFI_PAGE_SIZE - 1);
+
+   if (size > cache->size - end) {
+      end = CACHE_DATA;
+      while (TRUE) {
+         cache_entry* low = NULL;
+
+         for (UINTN i = 0; i < CACHE_ENTRIES; ++i) {
+            cache_entry* e = &cache->entry[i];
+
+            if (e->name[0] && e->offset >= end && (!low || e->offset < low->offset)) {
+               low = e;
+            }
+         }
+         if (!low) {
+            break;
+         }
+
+         if (low->offset != end) {
+            CopyMem((UINT8*)cache + end, (UINT8*)cache + low->offset, (UINTN)low->size);
+            low->offset = end;
+         }
+         end = (end + low->size + EFI_PAGE_SIZE - 1) & ~(UINT64)(EFI_PAGE_SIZE - 1);
+      }
+      cache_seal();
+
+      if (size > cache->size - end) {
+         return EFI_BUFFER_TOO_SMALL;
+      }
+   }
+
+   *offset = end;
+
+   return EFI_SUCCESS;
+}
+
+EFI_STATUS EFIAPI cache_file_open(
+      EFI_FILE_PROTOCOL* This,
+      EFI_FILE_PROTOCOL** NewHandle,
+      CHAR16* FileName,
+      UINT64 OpenMode,
+      UINT64 Attributes)
+{
+   return EFI_UNSUPPORTED;
+}
+
+EFI_STATUS EFIAPI cache_file_close(EFI_FILE_PROTOCOL* This)
+{
+   free_pool(This);
+
+   return EFI_SUCCESS;
+}
+
+EFI_STATUS EFIAPI cache_file_delete(EFI_FILE_PROTOCOL* This)
+{
+   cache_file_close(This);
+
+   return EFI_WARN_DELETE_FAILURE;
+}
+
+EFI_STATUS EFIAPI cache_file_read(EFI_FILE_PROTOCOL* This, UINTN* BufferSize, VOID* Buffer)
+{
+   cache_file* f = (cache_file*)This;
+   UINTN       size = *BufferSize;
+
+   if (f->pos > f->entry->size) {
+      return EFI_DEVICE_ERROR;
+   }
+
+   if (size > f->entry->size - f->pos) {
+      size = (UINTN)(f->entry->size - f->pos);
+   }
+
+   CopyMem(Buffer, (UINT8*)cache + f->entry->offset + f->pos, size);
+
+   f->pos += size;
+   *BufferSize = size;
+
+   return EFI_SUCCESS;
+}
+
+EFI_STATUS EFIAPI cache_file_write(EFI_FILE_PROTOCOL* This, UINTN* BufferSize, VOID* Buffer)
+{
+   return EFI_ACCESS_DENIED;
+}
+
+EFI_STATUS EFIAPI cache_file_get_position(EFI_FILE_PROTOCOL* This, UINT64* Position)
+{
+   *Position = ((cache_file*)This)->pos;
+
+   return EFI_SUCCESS;
+}
+
+EFI_STATUS EFIAPI cache_file_set_position(EFI_FILE_PROTOCOL* This, UINT64 Position)
+{
+   cache_file* f = (cache_file*)This;
+
+   f->pos = (Position == 0xffffffffffffffffULL) ? f->entry->size : Position;
+
+   return EFI_SUCCESS;
+}
+
+EFI_STATUS EFIAPI cache_file_get_info(
+      EFI_FILE_PROTOCOL* This,
+      EFI_GUID* InformationType,
+      UINTN* BufferSize,
+      VOID* Buffer)
+{
+   cache_file*    f = (cache_file*)This;
+   EFI_FILE_INFO* info = Buffer;
+   UINTN          size;
+
+   if (!CompareGuid(InformationType, &gEfiFileInfoGuid)) {
+      return EFI_UNSUPPORTED;
+   }
+
+   size = SIZE_OF_EFI_FILE_INFO + StrSize(f->entry->name);
+   if (*BufferSize < size) {
+      *BufferSize = size;
+      return EFI_BUFFER_TOO_SMALL;
+   }
+
+   SetMem(info, size, 0);
+   info->Size = size;
+   info->FileSize = f->entry->size;
+   info->PhysicalSize = f->entry->size;
+   CopyMem(&info->ModificationTime, &f->entry->mtime, sizeof(EFI_TIME));
+   CopyMem(&info->CreateTime, &f->entry->mtime, sizeof(EFI_TIME));
+   CopyMem(&info->LastAccessTime, &f->entry->mtime, sizeof(EFI_TIME));
+   info->Attribute = EFI_FILE_READ_ONLY;
+   CopyMem(info->FileName, f->entry->name, StrSize(f->entry->name));
+
+   *BufferSize = size;
+
+   return EFI_SUCCESS;
+}
+
+EFI_STATUS EFIAPI cache_file_set_info(
+      EFI_FILE_PROTOCOL* This,
+      EFI_GUID* InformationType,
+      UINTN BufferSize,
+      VOID* Buffer)
+{
+   return EFI_WRITE_PROTECTED;
+}
+
+EFI_STATUS EFIAPI cache_file_flush(EFI_FILE_PROTOCOL* This)
+{
+   return EFI_SUCCESS;
+}
+
+EFI_STATUS cache_file_new(cache_entry* entry, EFI_FILE_PROTOCOL** file)
+{
+   cache_file* f;
+
+   f = malloc_pool(sizeof(cache_file));
+   if (!f) {
+      return EFI_OUT_OF_RESOURCES;
+   }
+   SetMem(f, sizeof(cache_file), 0);
+
+   f->entry = entry;
+
+   f->file.Revision = EFI_FILE_PROTOCOL_REVISION;
+   f->file.Open = cache_file_open;
+   f->file.Close = cache_file_close;
+   f->file.Delete = cache_file_delete;
+   f->file.Read = cache_file_read;
+   f->file.Write = cache_file_write;
+   f->file.GetPosition = cache_file_get_position;
+   f->file.SetPosition = cache_file_set_position;
+   f->file.GetInfo = cache_file_get_info;
+   f->file.SetInfo = cache_file_set_info;
+   f->file.Flush = cache_file_flush;
+
+   *file = &f->file;
+
+   return EFI_SUCCESS;
+}
+
+EFI_STATUS get_file_info(EFI_FILE_PROTOCOL* file, UINT64* size, EFI_TIME* mtime)
+{
+   EFI_FILE_INFO* info;
+   UINTN          info_size;
+
+   EFI_STATUS  Status;
+
+   info_size = 0;
+   Status = file->GetInfo(file, &gEfiFileInfoGuid, &info_size, NULL);
+   if (Status != EFI_BUFFER_TOO_SMALL) {
+      return Status;
+   }
+
+   info = malloc_pool(info_size);
+   if (!info) {
+      return EFI_OUT_OF_RESOURCES;
+   }
+
+   Status = file->GetInfo(file, &gEfiFileInfoGuid, &info_size, info);
+   if (!EFI_ERROR(Status)) {
+      *size = info->FileSize;
+      CopyMem(mtime, &info->ModificationTime, sizeof(EFI_TIME));
+   }
+
+   free_pool(info);
+
+   return Status;
+}
+
+// Replace the opened file with its copy in the cache.
+// When the size, mtime and digest of the copy match, the file is not read;
+// otherwise it is read once into the cache.
+// On error *file is left as it was, at position 0.
+//
+EFI_STATUS cache_open(CONST CHAR16* name, EFI_FILE_PROTOCOL** file)
+{
+   EFI_FILE_PROTOCOL*   copy;
+   cache_entry*   entry;
+   UINT64   size;
+   UINT64   offset;
+   UINTN    read;
+   EFI_TIME mtime;
+
+   EFI_STATUS  Status;
+
+   if (!cache) {
+      return EFI_NOT_STARTED;
+   }
+
+   if (StrSize(name) > sizeof(entry->name)) {
+      return EFI_UNSUPPORTED;
+   }
+
+   Status = get_file_info(*file, &size, &mtime);
+   if (EFI_ERROR(Status)) {
+      return Status;
+   }
+
+   entry = NULL;
+   for (UINTN i = 0; i < CACHE_ENTRIES; ++i) {
+      if (cache->entry[i].name[0] && StrCmp(cache->entry[i].name, name) == 0) {
+         entry = &cache->entry[i];
+         break;
+      }
+   }
+
+   if (entry) {
+      if (entry->size == size
+       && CompareMem(&entry->mtime, &mtime, sizeof(EFI_TIME)) == 0
+       && cache_digest((UINT8*)cache + entry->offset, size) == entry->digest) {
+         Status = cache_file_new(entry, &copy);
+         if (EFI_ERROR(Status)) {
+            return Status;
+         }
+         (*file)->Close(*file);
+         *file = copy;
+
+         klog(LOG_INFO, L"cache: %s hit, %ld bytes\r\n", name, size);
+         return EFI_SUCCESS;
+      }
+
+      klog(LOG_INFO, L"cache: %s is stale\r\n", name);
+      SetMem(entry, sizeof(cache_entry), 0);
+      cache_seal();
+
+   } else {
+      for (UINTN i = 0; i < CACHE_ENTRIES; ++i) {
+         if (!cache->entry[i].name[0]) {
+            entry = &cache->entry[i];
+            break;
+         }
+      }
+      if (!entry) {
+         return EFI_OUT_OF_RESOURCES;
+      }
+   }
+
+   Status = cache_space(size, &offset);
+   if (EFI_ERROR(Status)) {
+      klog(LOG_WARN, L"cache: no room for %s, %ld bytes\r\n", name, size);
+      return Status;
+   }
+
+   read = (UINTN)size;
+   Status = (*file)->Read(*file, &read, (UINT8*)cache + offset);
+   if (EFI_ERROR(Status) || read != size) {
+      (*file)->SetPosition(*file, 0);
+      return EFI_ERROR(Status) ? Status : EFI_END_OF_FILE;
+   }
+
+   StrCpyS(entry->name, CACHE_NAME_MAX, name);
+   entry->offset = offset;
+   entry->size = size;
+   CopyMem(&entry->mtime, &mtime, sizeof(EFI_TIME));
+   entry->digest = cache_digest((UINT8*)cache + offset, size);
+   cache_seal();
+
+   Status = cache_file_new(entry, &copy);
+   if (EFI_ERROR(Status)) {
+      (*file)->SetPosition(*file, 0);
+      return Status;
+   }
+   (*file)->Close(*file);
+   *file = copy;
+
+   klog(LOG_INFO, L"cache: %s miss, %ld bytes cached\r\n", name, size);
+
+   return EFI_SUCCESS;
+}
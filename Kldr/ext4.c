@@ -0,0 +1,1022 @@
+/*
+ * Read-only ext4 reader on top of the DiskIo protocol.
+ *
+ * Copyright (c) 2022 norisio.dev
+ *
+ * SPDX short identifier: MIT
+ *
+ */
+
+#include <Uefi.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/BaseLib.h>
+#include <Protocol/LoadedImage.h>
+#include <Protocol/DevicePath.h>
+#include <Protocol/BlockIo.h>
+#include <Protocol/DiskIo.h>
+#include <Guid/FileInfo.h>
+
+#include "Kldr.h"
+
+#define EXT4_SUPER_OFFSET     1024
+#define EXT4_SUPER_MAGIC      0xef53
+#define EXT4_ROOT_INO         2
+#define EXT4_PATH_MAX         1024
+#define EXT4_LINK_MAX         8
+#define EXT4_DEPTH_MAX        5
+
+#define EXT4_INCOMPAT_COMPRESSION   0x0001
+#define EXT4_INCOMPAT_FILETYPE      0x0002
+#define EXT4_INCOMPAT_RECOVER       0x0004
+#define EXT4_INCOMPAT_JOURNAL_DEV   0x0008
+#define EXT4_INCOMPAT_META_BG       0x0010
+#define EXT4_INCOMPAT_64BIT         0x0080
+#define EXT4_INCOMPAT_DIRDATA       0x1000
+
+#define EXT4_INCOMPAT_UNSUPPORTED   (EXT4_INCOMPAT_COMPRESSION \
+                                   | EXT4_INCOMPAT_JOURNAL_DEV \
+                                   | EXT4_INCOMPAT_META_BG \
+                                   | EXT4_INCOMPAT_DIRDATA)
+
+#define EXT4_EXTENTS_FL       0x00080000
+#define EXT4_INLINE_DATA_FL   0x10000000
+
+#define EXT4_EXT_MAGIC        0xf30a
+#define EXT4_EXT_INIT_MAX     32768
+
+#define S_IFMT                0xf000
+#define S_IFLNK               0xa000
+#define S_IFREG               0x8000
+#define S_IFDIR               0x4000
+
+#pragma pack(push, 1)
+
+typedef struct {
+   UINT32   s_inodes_count;            // 0x00
+   UINT32   s_blocks_count_lo;
+   UINT32   s_r_blocks_count_lo;
+   UINT32   s_free_blocks_count_lo;
+   UINT32   s_free_inodes_count;       // 0x10
+   UINT32   s_first_data_block;
+   UINT32   s_log_block_size;
+   UINT32   s_log_cluster_size;
+   UINT32   s_blocks_per_group;        // 0x20
+   UINT32   s_clusters_per_group;
+   UINT32   s_inodes_per_group;
+   UINT32   s_mtime;
+   UINT32   s_wtime;                   // 0x30
+   UINT16   s_mnt_count;
+   UINT16   s_max_mnt_count;
+   UINT16   s_magic;
+   UINT16   s_state;
+   UINT16   s_errors;
+   UINT16   s_minor_rev_level;
+   UINT32   s_lastcheck;               // 0x40
+   UINT32   s_checkinterval;
+   UINT32   s_creator_os;
+   UINT32   s_rev_level;
+   UINT16   s_def_resuid;              // 0x50
+   UINT16   s_def_resgid;
+   UINT32   s_first_ino;
+   UINT16   s_inode_size;
+   UINT16   s_block_group_nr;
+   UINT32   s_feature_compat;
+   UINT32   s_feature_incompat;        // 0x60
+   UINT32   s_feature_ro_compat;
+   UINT8    s_uuid[16];
+   CHAR8    s_volume_name[16];         // 0x78
+   CHAR8    s_last_mounted[64];        // 0x88
+   UINT32   s_algorithm_usage_bitmap;  // 0xc8
+   UINT8    s_prealloc_blocks;
+   UINT8    s_prealloc_dir_blocks;
+   UINT16   s_reserved_gdt_blocks;
+   UINT8    s_journal_uuid[16];        // 0xd0
+   UINT32   s_journal_inum;            // 0xe0
+   UINT32   s_journal_dev;
+   UINT32   s_last_orphan;
+   UINT32   s_hash_seed[4];
+   UINT8    s_def_hash_version;        // 0xfc
+   UINT8    s_jnl_backup_type;
+   UINT16   s_desc_size;
+} ext4_super;
+
+typedef struct {
+   UINT32   bg_block_bitmap_lo;        // 0x00
+   UINT32   bg_inode_bitmap_lo;
+   UINT32   bg_inode_table_lo;
+   UINT8    _rsvd1[28];
+   UINT32   bg_inode_table_hi;         // 0x28, only with 64bit
+   UINT8    _rsvd2[20];
+} ext4_group_desc;
+
+typedef struct {
+   UINT16   i_mode;                    // 0x00
+   UINT16   i_uid;
+   UINT32   i_size_lo;
+   UINT32   i_atime;
+   UINT32   i_ctime;
+   UINT32   i_mtime;                   // 0x10
+   UINT32   i_dtime;
+   UINT16   i_gid;
+   UINT16   i_links_count;
+   UINT32   i_blocks_lo;
+   UINT32   i_flags;                   // 0x20
+   UINT32   i_osd1;
+   UINT32   i_block[15];               // 0x28
+   UINT32   i_generation;              // 0x64
+   UINT32   i_file_acl_lo;
+   UINT32   i_size_high;
+   UINT32   i_obso_faddr;
+   UINT8    i_osd2[12];                // 0x74
+} ext4_inode;
+
+typedef struct {
+   UINT16   eh_magic;
+   UINT16   eh_entries;
+   UINT16   eh_max;
+   UINT16   eh_depth;
+   UINT32   eh_generation;
+} ext4_extent_header;
+
+typedef struct {
+   UINT32   ee_block;
+   UINT16   ee_len;
+   UINT16   ee_start_hi;
+   UINT32   ee_start_lo;
+} ext4_extent;
+
+typedef struct {
+   UINT32   ei_block;
+   UINT32   ei_leaf_lo;
+   UINT16   ei_leaf_hi;
+   UINT16   ei_unused;
+} ext4_extent_idx;
+
+typedef struct {
+   UINT32   inode;
+   UINT16   rec_len;
+   UINT8    name_len;
+   UINT8    file_type;
+} ext4_dir_entry;
+
+#pragma pack(pop)
+
+typedef struct {
+   EFI_DISK_IO_PROTOCOL*   disk;
+   UINT32   media_id;
+   UINT32   block_size;
+   UINT32   inodes_per_group;
+   UINT32   inode_size;
+   UINT32   desc_size;
+   UINT32   first_data_block;
+   UINT32   incompat;
+} ext4_volume;
+
+// A run of blocks, physically contiguous extents are merged.
+//
+typedef struct {
+   UINT64   lblk;
+   UINT64   pblk;
+   UINT64   len;
+   BOOLEAN  uninit;
+} ext4_run;
+
+typedef struct {
+   ext4_run*   run;
+   UINTN       count;
+   UINTN       max;
+} ext4_map;
+
+typedef struct {
+   EFI_FILE_PROTOCOL file;             // must be first
+
+   ext4_volume vol;
+   ext4_map    map;
+   UINT64      size;
+   UINT64      pos;
+   UINT32      mtime;
+   CHAR16      name[64];
+} ext4_file;
+
+EFI_STATUS ext4_read_disk(ext4_volume* vol, UINT64 offset, UINTN size, VOID* buf)
+{
+   return vol->disk->ReadDisk(vol->disk, vol->media_id, offset, size, buf);
+}
+
+// "N:path" selects the partition N of the disk the loader is on.
+//
+BOOLEAN ext4_source(CONST CHAR16* source)
+{
+   if (*source < L'0' || L'9' < *source) {
+      return FALSE;
+   }
+   while (L'0' <= *source && *source <= L'9') {
+      ++source;
+   }
+
+   return *source == L':';
+}
+
+HARDDRIVE_DEVICE_PATH* find_hd_node(EFI_DEVICE_PATH_PROTOCOL* path)
+{
+   while (path->Type != END_DEVICE_PATH_TYPE) {
+      if (path->Type == MEDIA_DEVICE_PATH && path->SubType == MEDIA_HARDDRIVE_DP) {
+         return (HARDDRIVE_DEVICE_PATH*)path;
+      }
+      path = (EFI_DEVICE_PATH_PROTOCOL*)((UINT8*)path + path->Length[0] + path->Length[1] * 256);
+   }
+
+   return 0;
+}
+
+// Find the partition of the same disk as the loader by the partition number.
+//
+EFI_STATUS find_partition(UINT32 number, EFI_HANDLE* part)
+{
+   EFI_LOADED_IMAGE_PROTOCOL* li;
+   EFI_DEVICE_PATH_PROTOCOL*  self;
+   HARDDRIVE_DEVICE_PATH*     hd;
+   EFI_HANDLE*                handles;
+   UINTN                      count;
+   UINTN                      prefix;
+
+   EFI_STATUS  Status;
+
+   Status = gBS->HandleProtocol(gImageHandle, &gEfiLoadedImageProtocolGuid, (VOID**)&li);
+   if (EFI_ERROR(Status)) {
+      return Status;
+   }
+
+   Status = gBS->HandleProtocol(li->DeviceHandle, &gEfiDevicePathProtocolGuid, (VOID**)&self);
+   if (EFI_ERROR(Status)) {
+      return Status;
+   }
+
+   hd = find_hd_node(self);
+   if (!hd) {
+      return EFI_NOT_FOUND;
+   }
+   prefix = (UINT8*)hd - (UINT8*)self;
+
+   Status = gBS->LocateHandleBuffer(ByProtocol, &gEfiBlockIoProtocolGuid, NULL, &count, &handles);
+   if (EFI_ERROR(Status)) {
+      return Status;
+   }
+
+   Status = EFI_NOT_FOUND;
+   for (UINTN i = 0; i < count; ++i) {
+      EFI_DEVICE_PATH_PROTOCOL*  path;
+      HARDDRIVE_DEVICE_PATH*     node;
+
+      if (EFI_ERROR(gBS->HandleProtocol(handles[i], &gEfiDevicePathProtocolGuid, (VOID**)&path))) {
+         continue;
+      }
+
+      node = find_hd_node(path);
+      if (!node || (UINTN)((UINT8*)node - (UINT8*)path) != prefix) {
+         continue;
+      }
+
+      if (node->PartitionNumber == number && CompareMem(path, self, prefix) == 0) {
+         *part = handles[i];
+         Status = EFI_SUCCESS;
+         break;
+      }
+   }
+
+   gBS->FreePool(handles);
+
+   return Status;
+}
+
+EFI_STATUS ext4_mount(UINT32 number, ext4_volume* vol)
+{
+   EFI_HANDLE              part;
+   EFI_BLOCK_IO_PROTOCOL*  bio;
+   ext4_super              sb;
+
+   EFI_STATUS  Status;
+
+   Status = find_partition(number, &part);
+   if (EFI_ERROR(Status)) {
+      klog(LOG_ERR, L"ext4: partition %d not found\r\n", number);
+      return Status;
+   }
+
+   Status = gBS->HandleProtocol(part, &gEfiBlockIoProtocolGuid, (VOID**)&bio);
+   if (EFI_ERROR(Status)) {
+      return Status;
+   }
+
+   Status = gBS->HandleProtocol(part, &gEfiDiskIoProtocolGuid, (VOID**)&vol->disk);
+   if (EFI_ERROR(Status)) {
+      return Status;
+   }
+   vol->media_id = bio->Media->MediaId;
+
+   Status = ext4_read_disk(vol, EXT4_SUPER_OFFSET, sizeof(sb), &sb);
+   if (EFI_ERROR(Status)) {
+      return Status;
+   }
+
+   if (sb.s_magic != EXT4_SUPER_MAGIC) {
+      klog(LOG_ERR, L"ext4: partition %d is not ext2/3/4\r\n", number);
+      return EFI_UNSUPPORTED;
+   }
+
+   if (sb.s_feature_incompat & EXT4_INCOMPAT_UNSUPPORTED) {
+      klog(LOG_ERR, L"ext4: unsupported features %x\r\n", sb.s_feature_incompat);
+      return EFI_UNSUPPORTED;
+   }
+
+   if (sb.s_feature_incompat & EXT4_INCOMPAT_RECOVER) {
+      klog(LOG_WARN, L"ext4: journal needs recovery, reading anyway\r\n");
+   }
+
+   if (sb.s_log_block_size > 6 || !sb.s_inodes_per_group) {
+      return EFI_VOLUME_CORRUPTED;
+   }
+
+   vol->block_size = 1024 << sb.s_log_block_size;
+   vol->inodes_per_group = sb.s_inodes_per_group;
+   vol->inode_size = sb.s_rev_level ? sb.s_inode_size : 128;
+   vol->desc_size = 32;
+   if ((sb.s_feature_incompat & EXT4_INCOMPAT_64BIT) && sb.s_desc_size >= 64) {
+      vol->desc_size = sb.s_desc_size;
+   }
+   vol->first_data_block = sb.s_first_data_block;
+   vol->incompat = sb.s_feature_incompat;
+
+   if (vol->inode_size < sizeof(ext4_inode)) {
+      return EFI_VOLUME_CORRUPTED;
+   }
+
+   return EFI_SUCCESS;
+}
+
+EFI_STATUS ext4_read_inode(ext4_volume* vol, UINT32 ino, ext4_inode* inode)
+{
+   ext4_group_desc   gd;
+   UINT64            table;
+   UINT32            group;
+   UINT32            index;
+
+   EFI_STATUS  Status;
+
+   if (ino == 0) {
+      return EFI_NOT_FOUND;
+   }
+
+   group = (ino - 1) / vol->inodes_per_group;
+   index = (ino - 1) % vol->inodes_per_group;
+
+   SetMem(&gd, sizeof(gd), 0);
+   Status = ext4_read_disk(vol,
+         (UINT64)(vol->first_data_block + 1) * vol->block_size + (UINT64)group * vol->desc_size,
+         vol->desc_size < sizeof(gd) ? vol->desc_size : sizeof(gd),
+         &gd);
+   if (EFI_ERROR(Status)) {
+      return Status;
+   }
+
+   table = gd.bg_inode_table_lo;
+   if (vol->desc_size >= 64) {
+      table |= (UINT64)gd.bg_inode_table_hi << 32;
+   }
+
+   return ext4_read_disk(vol,
+         table * vol->block_size + (UINT64)index * vol->inode_size,
+         sizeof(ext4_inode),
+         inode);
+}
+
+EFI_STATUS map_add(ext4_map* map, UINT64 lblk, UINT64 pblk, UINT64 len, BOOLEAN uninit)
+{
+   ext4_run* last;
+
+   if (map->count) {
+      last = &map->run[map->count - 1];
+      if (last->uninit == uninit
+       && last->lblk + last->len == lblk
+       && last->pblk + last->len == pblk) {
+         last->len += len;
+         return EFI_SUCCESS;
+      }
+   }
+
+   if (map->count == map->max) {
+      ext4_run*   run;
+      UINTN       max = map->max ? map->max * 2 : 16;
+
+      run = malloc_pool(max * sizeof(ext4_run));
+      if (!run) {
+         return EFI_OUT_OF_RESOURCES;
+      }
+      if (map->run) {
+         CopyMem(run, map->run, map->count * sizeof(ext4_run));
+         free_pool(map->run);
+      }
+      map->run = run;
+      map->max = max;
+   }
+
+   last = &map->run[map->count++];
+   last->lblk = lblk;
+   last->pblk = pblk;
+   last->len = len;
+   last->uninit = uninit;
+
+   return EFI_SUCCESS;
+}
+
+VOID map_free(ext4_map* map)
+{
+   if (map->run) {
+      free_pool(map->run);
+   }
+   map->run = 0;
+   map->count = 0;
+   map->max = 0;
+}
+
+// Walk the extent tree and collect the runs in logical order.
+//
+EFI_STATUS ext4_walk(ext4_volume* vol, VOID* node, UINTN node_size, UINTN depth, ext4_map* map)
+{
+   ext4_extent_header*  eh = node;
+
+   EFI_STATUS  Status;
+
+   if (eh->eh_magic != EXT4_EXT_MAGIC
+    || eh->eh_depth != depth
+    || eh->eh_entries > (node_size - sizeof(ext4_extent_header)) / sizeof(ext4_extent)) {
+      return EFI_VOLUME_CORRUPTED;
+   }
+
+   if (depth == 0) {
+      ext4_extent* ex = (ext4_extent*)(eh + 1);
+
+      for (UINTN i = 0; i < eh->eh_entries; ++i) {
+         UINT64   len = ex[i].ee_len;
+         BOOLEAN  uninit = FALSE;
+
+         if (len > EXT4_EXT_INIT_MAX) {
+            len -= EXT4_EXT_INIT_MAX;
+            uninit = TRUE;
+         }
+
+         Status = map_add(map,
+               ex[i].ee_block,
+               ((UINT64)ex[i].ee_start_hi << 32) | ex[i].ee_start_lo,
+               len,
+               uninit);
+         if (EFI_ERROR(Status)) {
+            return Status;
+         }
+      }
+
+   } else {
+      ext4_extent_idx*  ix = (ext4_extent_idx*)(eh + 1);
+      VOID*             child;
+
+      child = malloc_pool(vol->block_size);
+      if (!child) {
+         return EFI_OUT_OF_RESOURCES;
+      }
+
+      for (UINTN i = 0; i < eh->eh_entries; ++i) {
+         UINT64 leaf = ((UINT64)ix[i].ei_leaf_hi << 32) | ix[i].ei_leaf_lo;
+
+         Status = ext4_read_disk(vol, leaf * vol->block_size, vol->block_size, child);
+         if (!EFI_ERROR(Status)) {
+            Status = ext4_walk(vol, child, vol->block_size, depth - 1, map);
+         }
+         if (EFI_ERROR(Status)) {
+            free_pool(child);
+            return Status;
+         }
+      }
+
+      free_pool(child);
+   }
+
+   return EFI_SUCCESS;
+}
+
+EFI_STATUS ext4_map_inode(ext4_volume* vol, ext4_inode* inode, ext4_map* map)
+{
+   ext4_extent_header*  eh = (ext4_extent_header*)inode->i_block;
+
+   if (inode->i_flags & EXT4_INLINE_DATA_FL) {
+      klog(LOG_ERR, L"ext4: inline data is not supported\r\n");
+      return EFI_UNSUPPORTED;
+   }
+
+   if (!(inode->i_flags & EXT4_EXTENTS_FL)) {
+      klog(LOG_ERR, L"ext4: block mapped files are not supported\r\n");
+      return EFI_UNSUPPORTED;
+   }
+
+   if (eh->eh_depth > EXT4_DEPTH_MAX) {
+      return EFI_VOLUME_CORRUPTED;
+   }
+
+   return ext4_walk(vol, eh, sizeof(inode->i_block), eh->eh_depth, map);
+}
+
+// Read [pos, pos + size) of the mapped file into buf.
+// Every run is read with a single request straight into buf,
+// holes and uninitialized extents are filled with zero.
+//
+EFI_STATUS ext4_read_map(ext4_volume* vol, ext4_map* map, UINT64 pos, UINTN size, UINT8* buf)
+{
+   UINT64   bs = vol->block_size;
+   UINT64   cur = pos;
+   UINT64   end = pos + size;
+
+   EFI_STATUS  Status;
+
+   for (UINTN i = 0; i < map->count && cur < end; ++i) {
+      ext4_run*   run = &map->run[i];
+      UINT64      run_start = run->lblk * bs;
+      UINT64      run_end = run_start + run->len * bs;
+      UINT64      chunk_end;
+
+      if (run_end <= cur) {
+         continue;
+      }
+      if (run_start >= end) {
+         break;
+      }
+
+      if (run_start > cur) {
+         SetMem(buf + (cur - pos), (UINTN)(run_start - cur), 0);
+         cur = run_start;
+      }
+
+      chunk_end = run_end < end ? run_end : end;
+
+      if (run->uninit) {
+         SetMem(buf + (cur - pos), (UINTN)(chunk_end - cur), 0);
+      } else {
+         Status = ext4_read_disk(vol,
+               run->pblk * bs + (cur - run_start),
+               (UINTN)(chunk_end - cur),
+               buf + (cur - pos));
+         if (EFI_ERROR(Status)) {
+            return Status;
+         }
+      }
+
+      cur = chunk_end;
+   }
+
+   if (cur < end) {
+      SetMem(buf + (cur - pos), (UINTN)(end - cur), 0);
+   }
+
+   return EFI_SUCCESS;
+}
+
+UINT64 inode_size(ext4_inode* inode)
+{
+   return ((UINT64)inode->i_size_high << 32) | inode->i_size_lo;
+}
+
+// Read the whole contents of a small inode (directory or symlink).
+//
+EFI_STATUS ext4_read_all(ext4_volume* vol, ext4_inode* inode, VOID** data, UINTN* size)
+{
+   ext4_map map;
+
+   EFI_STATUS  Status;
+
+   *size = (UINTN)inode_size(inode);
+
+   *data = malloc_pool(*size + 1);
+   if (!*data) {
+      return EFI_OUT_OF_RESOURCES;
+   }
+
+   SetMem(&map, sizeof(map), 0);
+   Status = ext4_map_inode(vol, inode, &map);
+   if (!EFI_ERROR(Status)) {
+      Status = ext4_read_map(vol, &map, 0, *size, *data);
+   }
+   map_free(&map);
+
+   if (EFI_ERROR(Status)) {
+      free_pool(*data);
+      return Status;
+   }
+   ((CHAR8*)*data)[*size] = 0;
+
+   return EFI_SUCCESS;
+}
+
+EFI_STATUS ext4_lookup(ext4_volume* vol, ext4_inode* dir, CONST CHAR8* name, UINTN len, UINT32* ino)
+{
+   UINT8*   data;
+   UINTN    size;
+   UINTN    off;
+
+   EFI_STATUS  Status;
+
+   if ((dir->i_mode & S_IFMT) != S_IFDIR) {
+      return EFI_NOT_FOUND;
+   }
+
+   Status = ext4_read_all(vol, dir, (VOID**)&data, &size);
+   if (EFI_ERROR(Status)) {
+      return Status;
+   }
+
+   // A linear scan also works for hashed directories,
+   // their index blocks look like empty entries.
+   //
+   Status = EFI_NOT_FOUND;
+   off = 0;
+   while (off + sizeof(ext4_dir_entry) <= size) {
+      ext4_dir_entry*   de = (ext4_dir_entry*)(data + off);
+      UINTN             name_len = de->name_len;
+
+      if (de->rec_len < sizeof(ext4_dir_entry) || off + de->rec_len > size) {
+         Status = EFI_VOLUME_CORRUPTED;
+         break;
+      }
+
+      if (!(vol->incompat & EXT4_INCOMPAT_FILETYPE)) {
+         name_len |= (UINTN)de->file_type << 8;
+      }
+
+      if (de->inode
+       && name_len == len
+       && sizeof(ext4_dir_entry) + name_len <= de->rec_len
+       && CompareMem(de + 1, name, len) == 0) {
+         *ino = de->inode;
+         Status = EFI_SUCCESS;
+         break;
+      }
+
+      off += de->rec_len;
+   }
+
+   free_pool(data);
+
+   return Status;
+}
+
+// Resolve the path from the root directory, following symbolic links.
+//
+EFI_STATUS ext4_resolve(ext4_volume* vol, CONST CHAR8* path, UINT32* ino, ext4_inode* inode)
+{
+   CHAR8    buf[EXT4_PATH_MAX];
+   CHAR8    tmp[EXT4_PATH_MAX];
+   CHAR8*   p;
+   UINT32   cur;
+   UINTN    links = 0;
+
+   EFI_STATUS  Status;
+
+   if (AsciiStrLen(path) >= EXT4_PATH_MAX) {
+      return EFI_INVALID_PARAMETER;
+   }
+   CopyMem(buf, path, AsciiStrLen(path) + 1);
+
+   cur = EXT4_ROOT_INO;
+   Status = ext4_read_inode(vol, cur, inode);
+   if (EFI_ERROR(Status)) {
+      return Status;
+   }
+
+   p = buf;
+   while (1) {
+      CHAR8*      name;
+      UINTN       len;
+      UINT32      child;
+      ext4_inode  cinode;
+
+      while (*p == '/') {
+         ++p;
+      }
+      if (!*p) {
+         break;
+      }
+
+      name = p;
+      while (*p && *p != '/') {
+         ++p;
+      }
+      len = p - name;
+
+      if (len == 1 && name[0] == '.') {
+         continue;
+      }
+
+      Status = ext4_lookup(vol, inode, name, len, &child);
+      if (EFI_ERROR(Status)) {
+         return Status;
+      }
+
+      Status = ext4_read_inode(vol, child, &cinode);
+      if (EFI_ERROR(Status)) {
+         return Status;
+      }
+
+      if ((cinode.i_mode & S_IFMT) == S_IFLNK) {
+         CHAR8*   target;
+         UINTN    tlen;
+         UINTN    rlen = AsciiStrLen(p);
+
+         if (++links > EXT4_LINK_MAX) {
+            return EFI_NOT_FOUND;
+         }
+
+         if (inode_size(&cinode) < sizeof(cinode.i_block) && !(cinode.i_flags & EXT4_EXTENTS_FL)) {
+            // fast symlink, the target is in i_block
+            //
+            target = (CHAR8*)cinode.i_block;
+            tlen = (UINTN)inode_size(&cinode);
+            if (tlen + rlen >= EXT4_PATH_MAX) {
+               return EFI_INVALID_PARAMETER;
+            }
+            CopyMem(tmp, target, tlen);
+
+         } else {
+            Status = ext4_read_all(vol, &cinode, (VOID**)&target, &tlen);
+            if (EFI_ERROR(Status)) {
+               return Status;
+            }
+            if (tlen + rlen >= EXT4_PATH_MAX) {
+               free_pool(target);
+               return EFI_INVALID_PARAMETER;
+            }
+            CopyMem(tmp, target, tlen);
+            free_pool(target);
+         }
+
+         // continue with the target followed by the rest of the path
+         //
+         CopyMem(tmp + tlen, p, rlen + 1);
+         CopyMem(buf, tmp, tlen + rlen + 1);
+         p = buf;
+
+         if (*p == '/') {
+            cur = EXT4_ROOT_INO;
+            Status = ext4_read_inode(vol, cur, inode);
+            if (EFI_ERROR(Status)) {
+               return Status;
+            }
+         }
+         continue;
+      }
+
+      cur = child;
+      CopyMem(inode, &cinode, sizeof(ext4_inode));
+   }
+
+   *ino = cur;
+
+   return EFI_SUCCESS;
+}
+
+VOID sec_to_efi_time(UINT64 sec, EFI_TIME* t)
+{
+   INT64    days = (INT64)(sec / 86400);
+   UINT64   rem = sec % 86400;
+   INT64    era;
+   INT64    doe;
+   INT64    yoe;
+   INT64    doy;
+   INT64    mp;
+   INT64    y;
+
+   // civil from days
+   //
+   days += 719468;
+   era = days / 146097;
+   doe = days - era * 146097;
+   yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+   y = yoe + era * 400;
+   doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+   mp = (5 * doy + 2) / 153;
+
+   SetMem(t, sizeof(EFI_TIME), 0);
+   t->Day = (UINT8)(doy - (153 * mp + 2) / 5 + 1);
+   t->Month = (UINT8)(mp < 10 ? mp + 3 : mp - 9);
+   t->Year = (UINT16)(t->Month <= 2 ? y + 1 : y);
+   t->Hour = (UINT8)(rem / 3600);
+   t->Minute = (UINT8)(rem / 60 % 60);
+   t->Second = (UINT8)(rem % 60);
+   t->TimeZone = EFI_UNSPECIFIED_TIMEZONE;
+}
+
+EFI_STATUS EFIAPI ext4_file_open(
+      EFI_FILE_PROTOCOL* This,
+      EFI_FILE_PROTOCOL** NewHandle,
+      CHAR16* FileName,
+      UINT64 OpenMode,
+      UINT64 Attributes)
+{
+   return EFI_UNSUPPORTED;
+}
+
+EFI_STATUS EFIAPI ext4_file_close(EFI_FILE_PROTOCOL* This)
+{
+   ext4_file* f = (ext4_file*)This;
+
+   map_free(&f->map);
+   free_pool(f);
+
+   return EFI_SUCCESS;
+}
+
+EFI_STATUS EFIAPI ext4_file_delete(EFI_FILE_PROTOCOL* This)
+{
+   ext4_file_close(This);
+
+   return EFI_WARN_DELETE_FAILURE;
+}
+
+EFI_STATUS EFIAPI ext4_file_read(EFI_FILE_PROTOCOL* This, UINTN* BufferSize, VOID* Buffer)
+{
+   ext4_file*  f = (ext4_file*)This;
+   UINTN       size = *BufferSize;
+
+   EFI_STATUS  Status;
+
+   if (f->pos > f->size) {
+      return EFI_DEVICE_ERROR;
+   }
+
+   if (size > f->size - f->pos) {
+      size = (UINTN)(f->size - f->pos);
+   }
+
+   Status = ext4_read_map(&f->vol, &f->map, f->pos, size, Buffer);
+   if (EFI_ERROR(Status)) {
+      *BufferSize = 0;
+      return Status;
+   }
+
+   f->pos += size;
+   *BufferSize = size;
+
+   return EFI_SUCCESS;
+}
+
+EFI_STATUS EFIAPI ext4_file_write(EFI_FILE_PROTOCOL* This, UINTN* BufferSize, VOID* Buffer)
+{
+   return EFI_ACCESS_DENIED;
+}
+
+EFI_STATUS EFIAPI ext4_file_get_position(EFI_FILE_PROTOCOL* This, UINT64* Position)
+{
+   *Position = ((ext4_file*)This)->pos;
+
+   return EFI_SUCCESS;
+}
+
+EFI_STATUS EFIAPI ext4_file_set_position(EFI_FILE_PROTOCOL* This, UINT64 Position)
+{
+   ext4_file* f = (ext4_file*)This;
+
+   f->pos = (Position == 0xffffffffffffffffULL) ? f->size : Position;
+
+   return EFI_SUCCESS;
+}
+
+EFI_STATUS EFIAPI ext4_file_get_info(
+      EFI_FILE_PROTOCOL* This,
+      EFI_GUID* InformationType,
+      UINTN* BufferSize,
+      VOID* Buffer)
+{
+   ext4_file*     f = (ext4_file*)This;
+   EFI_FILE_INFO* info = Buffer;
+   UINTN          size;
+
+   if (!CompareGuid(InformationType, &gEfiFileInfoGuid)) {
+      return EFI_UNSUPPORTED;
+   }
+
+   size = SIZE_OF_EFI_FILE_INFO + StrSize(f->name);
+   if (*BufferSize < size) {
+      *BufferSize = size;
+      return EFI_BUFFER_TOO_SMALL;
+   }
+
+   SetMem(info, size, 0);
+   info->Size = size;
+   info->FileSize = f->size;
+   info->PhysicalSize = (f->size + f->vol.block_size - 1) / f->vol.block_size * f->vol.block_size;
+   sec_to_efi_time(f->mtime, &info->ModificationTime);
+   CopyMem(&info->CreateTime, &info->ModificationTime, sizeof(EFI_TIME));
+   CopyMem(&info->LastAccessTime, &info->ModificationTime, sizeof(EFI_TIME));
+   info->Attribute = EFI_FILE_READ_ONLY;
+   CopyMem(info->FileName, f->name, StrSize(f->name));
+
+   *BufferSize = size;
+
+   return EFI_SUCCESS;
+}
+
+EFI_STATUS EFIAPI ext4_file_set_info(
+      EFI_FILE_PROTOCOL* This,
+      EFI_GUID* InformationType,
+      UINTN BufferSize,
+      VOID* Buffer)
+{
+   return EFI_WRITE_PROTECTED;
+}
+
+EFI_STATUS EFIAPI ext4_file_flush(EFI_FILE_PROTOCOL* This)
+{
+   return EFI_SUCCESS;
+}
+
+// Open "N:path" as a read-only EFI_FILE_PROTOCOL.
+//
+EFI_STATUS ext4_open(CONST CHAR16* source, EFI_FILE_PROTOCOL** file)
+{
+   ext4_file*  f;
+   ext4_inode  inode;
+   CHAR8       path[EXT4_PATH_MAX];
+   CONST CHAR16* p;
+   CONST CHAR16* base;
+   UINT32      number = 0;
+   UINT32      ino;
+   UINTN       i;
+
+   EFI_STATUS  Status;
+
+   if (!ext4_source(source)) {
+      return EFI_INVALID_PARAMETER;
+   }
+
+   for (p = source; *p != L':'; ++p) {
+      number = number * 10 + (*p - L'0');
+   }
+   ++p;
+
+   for (i = 0; p[i] && i < EXT4_PATH_MAX - 1; ++i) {
+      path[i] = (p[i] == L'\\') ? '/' : (CHAR8)p[i];
+   }
+   if (p[i]) {
+      return EFI_INVALID_PARAMETER;
+   }
+   path[i] = 0;
+
+   f = malloc_pool(sizeof(ext4_file));
+   if (!f) {
+      return EFI_OUT_OF_RESOURCES;
+   }
+   SetMem(f, sizeof(ext4_file), 0);
+
+   Status = ext4_mount(number, &f->vol);
+   if (!EFI_ERROR(Status)) {
+      Status = ext4_resolve(&f->vol, path, &ino, &inode);
+   }
+   if (!EFI_ERROR(Status) && (inode.i_mode & S_IFMT) != S_IFREG) {
+      Status = EFI_NOT_FOUND;
+   }
+   if (!EFI_ERROR(Status)) {
+      Status = ext4_map_inode(&f->vol, &inode, &f->map);
+   }
+   if (EFI_ERROR(Status)) {
+      klog(LOG_ERR, L"ext4: %s:%r\r\n", source, Status);
+      map_free(&f->map);
+      free_pool(f);
+      return Status;
+   }
+
+   f->size = inode_size(&inode);
+   f->mtime = inode.i_mtime;
+
+   base = p;
+   for (; *p; ++p) {
+      if (*p == L'/' || *p == L'\\') {
+         base = p + 1;
+      }
+   }
+   StrnCpyS(f->name, ARRAY_SIZE(f->name), base, ARRAY_SIZE(f->name) - 1);
+
+   f->file.Revision = EFI_FILE_PROTOCOL_REVISION;
+   f->file.Open = ext4_file_open;
+   f->file.Close = ext4_file_close;
+   f->file.Delete = ext4_file_delete;
+   f->file.Read = ext4_file_read;
+   f->file.Write = ext4_file_write;
+   f->file.GetPosition = ext4_file_get_position;
+   f->file.SetPosition = ext4_file_set_position;
+   f->file.GetInfo = ext4_file_get_info;
+   f->file.SetInfo = ext4_file_set_info;
+   f->file.Flush = ext4_file_flush;
+
+   klog(LOG_INFO, L"ext4: %s inode %d, %ld bytes in %d runs\r\n", source, ino, f->size, f->map.count);
+
+   *file = &f->file;
+
+   return EFI_SUCCESS;
+}
@@ -0,0 +1,397 @@
+/*
+ * Proximity domains of the memory from the ACPI SRAT.
+ *
+ * Copyright (c) 2022 norisio.dev
+ *
+ * SPDX short identifier: MIT
+ *
+ */
+
+#include <Uefi.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/BaseLib.h>
+
+#include "Kldr.h"
+
+#define NUMA_MAX_RANGES       64
+
+#define SRAT_SIGNATURE        0x54415253  // "SRAT"
+#define XSDT_SIGNATURE        0x54445358  // "XSDT"
+#define RSDT_SIGNATURE        0x54445352  // "RSDT"
+
+#define SRAT_CPU_AFFINITY     0
+#define SRAT_MEM_AFFINITY     1
+#define SRAT_X2APIC_AFFINITY  2
+
+#define SRAT_ENABLED          0x01
+#define SRAT_HOT_PLUGGABLE    0x02
+
+#pragma pack(push, 1)
+
+typedef struct {
+   UINT64   signature;
+   UINT8    checksum;
+   UINT8    oem_id[6];
+   UINT8    revision;
+   UINT32   rsdt;
+   UINT32   length;
+   UINT64   xsdt;
+   UINT8    ext_checksum;
+   UINT8    _rsvd[3];
+} acpi_rsdp;
+
+typedef struct {
+   UINT32   signature;
+   UINT32   length;
+   UINT8    revision;
+   UINT8    checksum;
+   UINT8    oem_id[6];
+   UINT64   oem_table_id;
+   UINT32   oem_revision;
+   UINT32   creator_id;
+   UINT32   creator_revision;
+} acpi_header;
+
+typedef struct {
+   acpi_header hdr;
+   UINT32   table_revision;
+   UINT64   _rsvd;
+} acpi_srat;
+
+typedef struct {
+   UINT8    type;
+   UINT8    length;
+} srat_entry;
+
+typedef struct {
+   srat_entry  hdr;
+   UINT8    proximity_lo;
+   UINT8    apic_id;
+   UINT32   flags;
+   UINT8    sapic_eid;
+   UINT8    proximity_hi[3];
+   UINT32   clock_domain;
+} srat_cpu;
+
+typedef struct {
+   srat_entry  hdr;
+   UINT32   proximity;
+   UINT16   _rsvd1;
+   UINT64   base;
+   UINT64   length;
+   UINT32   _rsvd2;
+   UINT32   flags;
+   UINT64   _rsvd3;
+} srat_mem;
+
+typedef struct {
+   srat_entry  hdr;
+   UINT16   _rsvd1;
+   UINT32   proximity;
+   UINT32   x2apic_id;
+   UINT32   flags;
+   UINT32   clock_domain;
+   UINT32   _rsvd2;
+} srat_x2apic;
+
+#pragma pack(pop)
+
+typedef struct {
+   UINT64   base;
+   UINT64   end;
+   UINT32   node;
+} numa_range;
+
+typedef struct {
+   BOOLEAN     probed;
+   BOOLEAN     ready;
+   UINT32      local;
+   UINTN       count;
+   numa_range  range[NUMA_MAX_RANGES];
+} numa_info;
+
+static numa_info numa;
+
+// APIC id of the processor running the loader, which is the BSP.
+//
+UINT32 bsp_apic_id(VOID)
+{
+   UINT32 max;
+   UINT32 ebx;
+   UINT32 edx;
+
+   AsmCpuid(0, &max, NULL, NULL, NULL);
+
+   if (max >= 0x0b) {
+      AsmCpuidEx(0x0b, 0, NULL, &ebx, NULL, &edx);
+      if (ebx) {
+         return edx;
+      }
+   }
+
+   AsmCpuid(1, NULL, &ebx, NULL, NULL);
+
+   return ebx >> 24;
+}
+
+acpi_srat* find_srat(UINT64 rsdp_addr)
+{
+   acpi_rsdp*     rsdp = (acpi_rsdp*)rsdp_addr;
+   acpi_header*   sdt;
+   UINTN          size;
+   UINTN          count;
+
+   if (!rsdp) {
+      return NULL;
+   }
+
+   if (rsdp->revision >= 2 && rsdp->xsdt) {
+      sdt = (acpi_header*)rsdp->xsdt;
+      size = sizeof(UINT64);
+      if (sdt->signature != XSDT_SIGNATURE) {
+         return NULL;
+      }
+   } else {
+      sdt = (acpi_header*)(UINT64)rsdp->rsdt;
+      size = sizeof(UINT32);
+      if (!sdt || sdt->signature != RSDT_SIGNATURE) {
+         return NULL;
+      }
+   }
+
+   count = (sdt->length - sizeof(acpi_header)) / size;
+   for (UINTN i = 0; i < count; ++i) {
+      UINT8*         entry = (UINT8*)(sdt + 1) + i * size;
+      acpi_header*   table;
+
+      if (size == sizeof(UINT64)) {
+         table = (acpi_header*)ReadUnaligned64((UINT64*)entry);
+      } else {
+         table = (acpi_header*)(UINT64)ReadUnaligned32((UINT32*)entry);
+      }
+
+      if (table && table->signature == SRAT_SIGNATURE) {
+         return (acpi_srat*)table;
+      }
+   }
+
+   return NULL;
+}
+
+// Read the memory ranges and the node of the BSP from the SRAT.
+// Placement is left to the firmware when there is only one node.
+//
+EFI_STATUS numa_init(UINT64 rsdp)
+{
+   acpi_srat*  srat;
+   UINT8*      p;
+   UINT8*      end;
+   UINT32      apic_id;
+   UINT32      nodes;
+   BOOLEAN     found;
+
+   if (numa.probed) {
+      return numa.ready ? EFI_SUCCESS : EFI_NOT_FOUND;
+   }
+   numa.probed = TRUE;
+
+   srat = find_srat(rsdp);
+   if (!srat) {
+      klog(LOG_INFO, L"numa: no SRAT\r\n");
+      return EFI_NOT_FOUND;
+   }
+
+   apic_id = bsp_apic_id();
+   found = FALSE;
+   nodes = 0;
+
+   p = (UINT8*)(srat + 1);
+   end = (UINT8*)srat + srat->hdr.length;
+   while (p + sizeof(srat_entry) <= end) {
+      srat_entry* entry = (srat_entry*)p;
+
+      if (entry->length < sizeof(srat_entry) || p + entry->length > end) {
+         break;
+      }
+
+      if (entry->type == SRAT_CPU_AFFINITY && entry->length >= sizeof(srat_cpu)) {
+         srat_cpu* cpu = (srat_cpu*)entry;
+
+         if ((cpu->flags & SRAT_ENABLED) && cpu->apic_id == apic_id) {
+            numa.local = (UINT32)cpu->proximity_lo
+                       | ((UINT32)cpu->proximity_hi[0] << 8)
+                       | ((UINT32)cpu->proximity_hi[1] << 16)
+                       | ((UINT32)cpu->proximity_hi[2] << 24);
+            found = TRUE;
+         }
+
+      } else if (entry->type == SRAT_X2APIC_AFFINITY && entry->length >= sizeof(srat_x2apic)) {
+         srat_x2apic* cpu = (srat_x2apic*)entry;
+
+         if ((cpu->flags & SRAT_ENABLED) && cpu->x2apic_id == apic_id) {
+            numa.local = cpu->proximity;
+            found = TRUE;
+         }
+
+      } else if (entry->type == SRAT_MEM_AFFINITY && entry->length >= sizeof(srat_mem)) {
+         srat_mem* mem = (srat_mem*)entry;
+
+         // hot pluggable ranges are not populated at boot
+         //
+         if ((mem->flags & SRAT_ENABLED) && !(mem->flags & SRAT_HOT_PLUGGABLE) && mem->length) {
+            BOOLEAN known = FALSE;
+
+            for (UINTN i = 0; i < numa.count; ++i) {
+               known |= numa.range[i].node == mem->proximity;
+            }
+            if (!known) {
+               ++nodes;
+            }
+
+            if (numa.count < NUMA_MAX_RANGES) {
+               numa.range[numa.count].base = mem->base;
+               numa.range[numa.count].end = mem->base + mem->length;
+               numa.range[numa.count].node = mem->proximity;
+               ++numa.count;
+            } else {
+               klog(LOG_WARN, L"numa: too many memory ranges\r\n");
+            }
+         }
+      }
+
+      p += entry->length;
+   }
+
+   if (!found) {
+      klog(LOG_INFO, L"numa: apic id %d not in SRAT\r\n", apic_id);
+      return EFI_NOT_FOUND;
+   }
+
+   if (nodes < 2) {
+      klog(LOG_INFO, L"numa: %d node\r\n", nodes);
+      return EFI_NOT_FOUND;
+   }
+
+   klog(LOG_INFO, L"numa: %d nodes, %d ranges, apic id %d on node %d\r\n", nodes, numa.count, apic_id, numa.local);
+   numa.ready = TRUE;
+
+   return EFI_SUCCESS;
+}
+
+// Node of the address, or NUMA_NO_NODE.
+//
+UINT32 numa_node(UINT64 addr)
+{
+   for (UINTN i = 0; i < numa.count; ++i) {
+      if (numa.range[i].base <= addr && addr < numa.range[i].end) {
+         return numa.range[i].node;
+      }
+   }
+
+   return NUMA_NO_NODE;
+}
+
+// Find the highest free range in the node of the BSP which holds size bytes
+// at the alignment and ends at or below limit.
+// The caller allocates it with AllocateAddress.
+//
+EFI_STATUS numa_find(UINT64 size, UINT64 align, UINT64 limit, EFI_PHYSICAL_ADDRESS* addr)
+{
+   UINT8*   map;
+   UINTN    map_size;
+   UINTN    key;
+   UINTN    desc_size;
+   UINT32   desc_ver;
+   BOOLEAN  found;
+
+   EFI_STATUS  Status;
+
+   if (!numa.ready) {
+      return EFI_NOT_FOUND;
+   }
+
+   size = (size + EFI_PAGE_SIZE - 1) & ~(UINT64)(EFI_PAGE_SIZE - 1);
+   if (align < EFI_PAGE_SIZE) {
+      align = EFI_PAGE_SIZE;
+   }
+
+   map_size = 0;
+   Status = gBS->GetMemoryMap(&map_size, NULL, &key, &desc_size, &desc_ver);
+   if (Status != EFI_BUFFER_TOO_SMALL) {
+      return Status;
+   }
+
+   // room for the descriptors the allocation may split
+   //
+   map_size += 4 * desc_size;
+   map = malloc_pool(map_size);
+   if (!map) {
+      return EFI_OUT_OF_RESOURCES;
+   }
+
+   Status = gBS->GetMemoryMap(&map_size, (EFI_MEMORY_DESCRIPTOR*)map, &key, &desc_size, &desc_ver);
+   if (EFI_ERROR(Status)) {
+      free_pool(map);
+      return Status;
+   }
+
+   found = FALSE;
+   for (UINTN i = 0; i < map_size / desc_size; ++i) {
+      EFI_MEMORY_DESCRIPTOR* desc = (EFI_MEMORY_DESCRIPTOR*)(map + i * desc_size);
+
+      UINT64 base;
+      UINT64 end;
+
+      if (desc->Type != EfiConventionalMemory) {
+         continue;
+      }
+
+      base = desc->PhysicalStart;
+      end = base + EFI_PAGES_TO_SIZE(desc->NumberOfPages);
+
+      for (UINTN r = 0; r < numa.count; ++r) {
+         UINT64 lo;
+         UINT64 hi;
+         UINT64 at;
+
+         if (numa.range[r].node != numa.local) {
+            continue;
+         }
+
+         lo = MAX(base, numa.range[r].base);
+         hi = MIN(end, numa.range[r].end);
+         if (hi - 1 > limit) {
+            hi = limit + 1;
+         }
+         if (hi <= lo || hi - lo < size) {
+            continue;
+         }
+
+         at = (hi - size) & ~(align - 1);
+         if (at < lo) {
+            continue;
+         }
+
+         if (!found || at > *addr) {
+            *addr = at;
+            found = TRUE;
+         }
+      }
+   }
+
+   free_pool(map);
+
+   return found ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+// TRUE when the whole range is on the node of the BSP.
+//
+BOOLEAN numa_local(UINT64 base, UINT64 size)
+{
+   if (!numa.ready) {
+      return FALSE;
+   }
+
+   return numa_node(base) == numa.local && numa_node(base + size - 1) == numa.local;
+}
@@ -0,0 +1,304 @@
+/*
+ * Placement of the boot allocations, checked before any file is read.
+ *
+ * Copyright (c) 2022 norisio.dev
+ *
+ * SPDX short identifier: MIT
+ *
+ */
+
+#include <Uefi.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/BaseLib.h>
+
+#include "Kldr.h"
+
+#define PLAN_MAX        8
+
+// Nothing is placed in the first 1MB, an address of 0 means
+// "not allocated" to the loader.
+//
+#define PLAN_LOW        0x100000
+
+typedef struct {
+   UINT64   base;
+   UINT64   end;
+} plan_range;
+
+static plan_item  plan[PLAN_MAX];
+static VOID*      plan_ptr[PLAN_MAX];
+static UINTN      plan_count;
+
+// Free conventional memory from one snapshot of the memory map,
+// with room for the pieces the placements split off.
+//
+EFI_STATUS plan_free(plan_range** avail, UINTN* count, UINTN extra)
+{
+   UINT8*   map;
+   UINTN    map_size;
+   UINTN    key;
+   UINTN    desc_size;
+   UINT32   desc_ver;
+
+   EFI_STATUS  Status;
+
+   map_size = 0;
+   Status = gBS->GetMemoryMap(&map_size, NULL, &key, &desc_size, &desc_ver);
+   if (Status != EFI_BUFFER_TOO_SMALL) {
+      return Status;
+   }
+
+   map_size += 4 * desc_size;
+   map = malloc_pool(map_size);
+   if (!map) {
+      return EFI_OUT_OF_RESOURCES;
+   }
+
+   Status = gBS->GetMemoryMap(&map_size, (EFI_MEMORY_DESCRIPTOR*)map, &key, &desc_size, &desc_ver);
+   if (EFI_ERROR(Status)) {
+      free_pool(map);
+      return Status;
+   }
+
+   *avail = malloc_pool((map_size / desc_size + extra) * sizeof(plan_range));
+   if (!*avail) {
+      free_pool(map);
+      return EFI_OUT_OF_RESOURCES;
+   }
+
+   *count = 0;
+   for (UINTN i = 0; i < map_size / desc_size; ++i) {
+      EFI_MEMORY_DESCRIPTOR* desc = (EFI_MEMORY_DESCRIPTOR*)(map + i * desc_size);
+
+      if (desc->Type != EfiConventionalMemory) {
+         continue;
+      }
+
+      (*avail)[*count].base = MAX(desc->PhysicalStart, PLAN_LOW);
+      (*avail)[*count].end = desc->PhysicalStart + EFI_PAGES_TO_SIZE(desc->NumberOfPages);
+      if ((*avail)[*count].base < (*avail)[*count].end) {
+         ++*count;
+      }
+   }
+
+   free_pool(map);
+
+   return EFI_SUCCESS;
+}
+
+// Highest free address for the item, on the node of the BSP when it can be.
+//
+BOOLEAN plan_place(plan_item* item, plan_range* avail, UINTN count, UINTN* range)
+{
+   BOOLEAN  found = FALSE;
+   BOOLEAN  local = FALSE;
+
+   for (UINTN i = 0; i < count; ++i) {
+      UINT64   hi;
+      UINT64   at;
+      BOOLEAN  near;
+
+      hi = avail[i].end;
+      if (hi - 1 > item->limit) {
+         hi = item->limit + 1;
+      }
+      if (hi <= avail[i].base || hi - avail[i].base < item->size) {
+         continue;
+      }
+
+      at = (hi - item->size) & ~(item->align - 1);
+      if (at < avail[i].base) {
+         continue;
+      }
+
+      near = numa_local(at, item->size);
+      if (!found || (near && !local) || (near == local && at > item->addr)) {
+         item->addr = at;
+         *range = i;
+         found = TRUE;
+         local = near;
+      }
+   }
+
+   return found;
+}
+
+// Largest free block below limit, for the report.
+//
+UINT64 plan_largest(plan_range* avail, UINTN count, UINT64 limit)
+{
+   UINT64 largest = 0;
+
+   for (UINTN i = 0; i < count; ++i) {
+      UINT64 hi = avail[i].end;
+
+      if (hi - 1 > limit) {
+         hi = limit + 1;
+      }
+      if (hi > avail[i].base && hi - avail[i].base > largest) {
+         largest = hi - avail[i].base;
+      }
+   }
+
+   return largest;
+}
+
+// Choose an address for every item, the largest first, and reserve it
+// until plan_take hands it over.
+// Items with addr set must be placed there, items of size 0 are
+// skipped. All the items are tried, so that the report shows everything missing.
+//
+EFI_STATUS plan_fit(plan_item* items, UINTN count)
+{
+   plan_range* avail;
+   UINTN       nfree;
+   UINTN       order[PLAN_MAX];
+   UINT64      total;
+   BOOLEAN     fit;
+
+   EFI_STATUS  Status;
+
+   plan_release();
+
+   if (count > PLAN_MAX) {
+      return EFI_INVALID_PARAMETER;
+   }
+
+   Status = plan_free(&avail, &nfree, count);
+   if (EFI_ERROR(Status)) {
+      return Status;
+   }
+
+   total = 0;
+   for (UINTN i = 0; i < nfree; ++i) {
+      total += avail[i].end - avail[i].base;
+   }
+
+   // fixed ones first, then by size
+   //
+   for (UINTN i = 0; i < count; ++i) {
+      items[i].size = (items[i].size + EFI_PAGE_SIZE - 1) & ~(UINT64)(EFI_PAGE_SIZE - 1);
+      if (items[i].align < EFI_PAGE_SIZE) {
+         items[i].align = EFI_PAGE_SIZE;
+      }
+      order[i] = i;
+   }
+   for (UINTN i = 0; i < count; ++i) {
+      for (UINTN j = i + 1; j < count; ++j) {
+         plan_item* a = &items[order[i]];
+         plan_item* b = &items[order[j]];
+
+         if ((b->addr && !a->addr) || (!b->addr == !a->addr && b->size > a->size)) {
+            UINTN t = order[i];
+            order[i] = order[j];
+            order[j] = t;
+         }
+      }
+   }
+
+   fit = TRUE;
+   for (UINTN n = 0; n < count; ++n) {
+      plan_item*  item = &items[order[n]];
+      UINTN       r = nfree;
+      BOOLEAN     placed;
+
+      if (!item->size) {
+         continue;
+      }
+
+      if (item->addr) {
+         for (UINTN i = 0; i < nfree; ++i) {
+            if (avail[i].base <= item->addr && item->addr + item->size <= avail[i].end) {
+               r = i;
+            }
+         }
+         placed = r < nfree;
+      } else {
+         placed = plan_place(item, avail, nfree, &r);
+      }
+
+      if (!placed) {
+         if (item->addr) {
+            klog(LOG_ERR, L"plan: %s needs %ld KB at %lx, which is not free\r\n",
+                  item->what, item->size >> 10, item->addr);
+         } else {
+            klog(LOG_ERR, L"plan: %s needs %ld KB below %lx, the largest free block there is %ld KB\r\n",
+                  item->what, item->size >> 10, item->limit, plan_largest(avail, nfree, item->limit) >> 10);
+         }
+         fit = FALSE;
+         continue;
+      }
+
+      klog(LOG_INFO, L"plan: %s %ld KB at %lx\r\n", item->what, item->size >> 10, item->addr);
+
+      // split the range around the placement
+      //
+      avail[nfree].base = item->addr + item->size;
+      avail[nfree].end = avail[r].end;
+      avail[r].end = item->addr;
+      ++nfree;
+   }
+
+   free_pool(avail);
+
+   if (!fit) {
+      klog(LOG_ERR, L"plan: %ld KB free in total\r\n", total >> 10);
+      return EFI_OUT_OF_RESOURCES;
+   }
+
+   // nothing allocates between the snapshot and here, a failure means
+   // the firmware did, and the load of the item finds another place
+   //
+   for (UINTN i = 0; i < count; ++i) {
+      plan[i] = items[i];
+      plan_ptr[i] = NULL;
+      if (!items[i].size) {
+         continue;
+      }
+
+      plan_ptr[i] = malloc_pages_at(items[i].size, items[i].addr);
+      if (!plan_ptr[i]) {
+         klog(LOG_WARN, L"plan: %s at %lx was taken\r\n", items[i].what, items[i].addr);
+      }
+   }
+   plan_count = count;
+
+   return EFI_SUCCESS;
+}
+
+// Hand the pages reserved for what over to the caller, NULL when size
+// bytes do not fit in them. The pages past size are freed, so that the
+// caller frees size bytes as for any other allocation.
+//
+VOID* plan_take(CONST CHAR16* what, UINT64 size)
+{
+   size = (size + EFI_PAGE_SIZE - 1) & ~(UINT64)(EFI_PAGE_SIZE - 1);
+
+   for (UINTN i = 0; i < plan_count; ++i) {
+      if (plan_ptr[i] && StrCmp(plan[i].what, what) == 0 && size && size <= plan[i].size) {
+         UINT8* ptr = plan_ptr[i];
+
+         if (size < plan[i].size) {
+            free_pages(ptr + size, plan[i].size - size);
+         }
+         plan_ptr[i] = NULL;
+         return ptr;
+      }
+   }
+
+   return NULL;
+}
+
+// Free the reservations nobody took.
+//
+VOID plan_release(VOID)
+{
+   for (UINTN i = 0; i < plan_count; ++i) {
+      if (plan_ptr[i]) {
+         free_pages(plan_ptr[i], plan[i].size);
+         plan_ptr[i] = NULL;
+      }
+   }
+   plan_count = 0;
+}
@@ -0,0 +1,146 @@
+#!/usr/bin/env python3
+#
+# Warm reboot cache test of Kldr on QEMU + OVMF, run by "make cache-test".
+#
+# The test kernel is booted three times with "cache=":
+#   1. first boot, the files are read and cached
+#   2. "system_reset" on the monitor of the same QEMU, the files are
+#      taken from the cache
+#   3. a new QEMU process, the cache is gone and the files are read again
+# Each boot must pass the checks of the test kernel, whose output
+# includes the log of Kldr.
+#
+# Copyright (c) 2022 norisio.dev
+#
+# SPDX short identifier: MIT
+#
+
+import argparse
+import os
+import socket
+import subprocess
+import sys
+import time
+
+RESULT = 'RESULT '
+PASS = 'RESULT PASS'
+
+def read_log(path):
+    if not os.path.exists(path):
+        return ''
+    with open(path, 'rb') as f:
+        return f.read().decode('ascii', 'replace')
+
+# Wait until the log has count results, return the log.
+def wait_result(qemu, path, count, timeout):
+    end = time.time() + timeout
+    while time.time() < end:
+        log = read_log(path)
+        if log.count(RESULT) >= count:
+            # the rest of the result line
+            time.sleep(0.5)
+            return read_log(path)
+        if qemu.poll() is not None:
+            break
+        time.sleep(0.5)
+    return None
+
+def monitor(path, *commands):
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.connect(path)
+    for c in commands:
+        s.sendall((c + '\n').encode())
+        time.sleep(0.5)
+    s.close()
+
+def start(args, log):
+    for f in (log, args.monitor):
+        if os.path.exists(f):
+            os.remove(f)
+
+    # the test kernel powers off after the checks, -no-shutdown keeps
+    # QEMU and the memory for the reset
+    qemu = subprocess.Popen([args.qemu,
+        '-machine', 'q35', '-m', '512', '-display', 'none', '-no-shutdown',
+        '-drive', 'if=pflash,format=raw,readonly=on,file=' + args.ovmf,
+        '-drive', 'if=pflash,format=raw,file=' + args.vars,
+        '-drive', 'format=raw,file=fat:rw:' + args.esp,
+        '-debugcon', 'file:' + log,
+        '-serial', 'null',
+        '-monitor', 'unix:%s,server=on,wait=off' % args.monitor])
+
+    end = time.time() + 10
+    while not os.path.exists(args.monitor) and time.time() < end:
+        time.sleep(0.1)
+
+    return qemu
+
+def stop(qemu, args):
+    if qemu.poll() is None:
+        try:
+            monitor(args.monitor, 'quit')
+            qemu.wait(10)
+        except (OSError, subprocess.TimeoutExpired):
+            qemu.kill()
+            qemu.wait()
+
+# The boot passed and the log of Kldr has every line in want.
+def check(name, log, want, unwanted):
+    ok = True
+    if log is None:
+        print('%s: no result' % name)
+        return False
+    if PASS not in log:
+        print('%s: the test kernel failed' % name)
+        ok = False
+    for w in want:
+        if w not in log:
+            print('%s: "%s" not in the log' % (name, w))
+            ok = False
+    for w in unwanted:
+        if w in log:
+            print('%s: "%s" in the log' % (name, w))
+            ok = False
+    print('%s: %s' % (name, 'PASS' if ok else 'FAIL'))
+    return ok
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--qemu', default='qemu-system-x86_64')
+    parser.add_argument('--ovmf', required=True)
+    parser.add_argument('--vars', required=True)
+    parser.add_argument('--esp', required=True)
+    parser.add_argument('--monitor', default='monitor.sock')
+    parser.add_argument('--timeout', type=int, default=120)
+    args = parser.parse_args()
+
+    hit = 'cache: bzimage hit'
+    miss = 'cache: bzimage miss'
+
+    ok = True
+
+    qemu = start(args, 'cache-warm.log')
+    try:
+        log = wait_result(qemu, 'cache-warm.log', 1, args.timeout)
+        ok &= check('first boot', log, [miss], [hit])
+
+        if log is not None:
+            monitor(args.monitor, 'system_reset', 'cont')
+            log = wait_result(qemu, 'cache-warm.log', 2, args.timeout)
+            if log is not None:
+                log = log[log.find(RESULT) + len(RESULT):]
+            ok &= check('warm reset', log, [hit, 'cache: initrd hit'], [miss])
+    finally:
+        stop(qemu, args)
+
+    qemu = start(args, 'cache-cold.log')
+    try:
+        log = wait_result(qemu, 'cache-cold.log', 1, args.timeout)
+        ok &= check('cold start', log, [miss], [hit])
+    finally:
+        stop(qemu, args)
+
+    return 0 if ok else 1
+
+if __name__ == '__main__':
+    sys.exit(main())
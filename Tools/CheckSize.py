@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+#
+# POSTBUILD script of KldrPkg.dsc, fails the build when KldrBoot.efi
+# is larger than the limit, and shows the limit that leaves 1/8 of
+# headroom above the size. A limit of 0 turns the check off with a warning.
+#
+# Copyright (c) 2022 norisio.dev
+#
+# SPDX short identifier: MIT
+#
+
+import argparse
+import os
+import sys
+
+# size + 1/8, rounded up to 4 KiB
+def suggest(size):
+    return (size + size // 8 + 4095) // 4096 * 4096
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--limit', type=int, required=True)
+    parser.add_argument('--output', default=os.path.join(os.environ.get('WORKSPACE', '.'), 'Build', 'Kldr'))
+    parser.add_argument('-b', dest='target', default='RELEASE')
+    parser.add_argument('-t', dest='toolchain', default='GCC5')
+    parser.add_argument('-a', dest='arch', action='append')
+    args, _ = parser.parse_known_args()
+
+    ret = 0
+    for arch in args.arch or ['X64']:
+        out = os.path.join(args.output, args.target + '_' + args.toolchain, arch)
+
+        full = os.path.join(out, 'Kldr.efi')
+        if os.path.exists(full):
+            print('Kldr.efi     %7d bytes' % os.path.getsize(full))
+
+        boot = os.path.join(out, 'KldrBoot.efi')
+        if not os.path.exists(boot):
+            print('%s not found' % boot)
+            ret = 1
+            continue
+
+        size = os.path.getsize(boot)
+        if not args.limit:
+            print('KldrBoot.efi %7d bytes, suggested limit %d' % (size, suggest(size)))
+            print('WARNING: KLDR_BOOT_SIZE_LIMIT is 0, the size of KldrBoot.efi is not checked')
+            continue
+
+        print('KldrBoot.efi %7d bytes, limit %d, suggested %d' % (size, args.limit, suggest(size)))
+        if size > args.limit:
+            print('KldrBoot.efi exceeds the limit by %d bytes' % (size - args.limit))
+            ret = 1
+
+    return ret
+
+if __name__ == '__main__':
+    sys.exit(main())